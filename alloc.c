@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#include "alloc.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// from linux/mempolicy.h, which we call through syscall() rather than pull in
+// libnuma
+#define MPOL_PREFERRED 1
+
+static inline size_t round_up_to_huge_page(size_t size) {
+  return (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+}
+
+/**
+ * Maps size bytes (a multiple of HUGE_PAGE_SIZE) aligned to HUGE_PAGE_SIZE,
+ * so that transparent huge pages can back all of it.
+ */
+static void* map_aligned(size_t size) {
+  size_t mapsize = size + HUGE_PAGE_SIZE;
+  uint8_t* map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  // trim the unaligned ends
+  uint8_t* aligned = (uint8_t*) (((uintptr_t) map + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+  if (aligned != map) {
+    munmap(map, aligned - map);
+  }
+  if (map + mapsize != aligned + size) {
+    munmap(aligned + size, map + mapsize - (aligned + size));
+  }
+  return aligned;
+}
+
+static void bind_to_local_node(void* ptr, size_t size) {
+  unsigned cpu, node;
+  if (getcpu(&cpu, &node) || node >= sizeof(unsigned long) * 8) {
+    return;
+  }
+  unsigned long nodemask = 1ul << node;
+  // failure leaves the default first-touch policy in place, which still puts
+  // pages on the local node as long as this thread is the first to use them
+  syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+}
+
+void* large_alloc(size_t size, int flags) {
+  if (!flags) {
+    return calloc(size, 1);
+  }
+
+  size_t mapsize = round_up_to_huge_page(size);
+  void* ptr = MAP_FAILED;
+  if (flags & ALLOC_HUGE_PAGES) {
+    // only succeeds if the admin has reserved huge pages
+    ptr = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (ptr == MAP_FAILED) {
+    ptr = map_aligned(mapsize);
+    if (!ptr) {
+      return NULL;
+    }
+    if (flags & ALLOC_HUGE_PAGES) {
+      madvise(ptr, mapsize, MADV_HUGEPAGE);
+    }
+  }
+
+  // the mapping isn't backed by anything until it's touched, so binding it
+  // now decides where all of it ends up
+  if (flags & ALLOC_LOCAL_NODE) {
+    bind_to_local_node(ptr, mapsize);
+  }
+  return ptr;
+}
+
+void* large_realloc(void* ptr, size_t oldsize, size_t newsize, int flags) {
+  if (!flags) {
+    return realloc(ptr, newsize);
+  }
+  if (!ptr) {
+    return large_alloc(newsize, flags);
+  }
+  if (round_up_to_huge_page(oldsize) == round_up_to_huge_page(newsize)) {
+    return ptr;
+  }
+  void* newptr = large_alloc(newsize, flags);
+  if (!newptr) {
+    return NULL;
+  }
+  memcpy(newptr, ptr, oldsize < newsize ? oldsize : newsize);
+  large_free(ptr, oldsize, flags);
+  return newptr;
+}
+
+/**
+ * Reads a sysfs list of CPUs or nodes, like "0-3,8-11", into set.
+ * Returns whether it held anything.
+ */
+static int read_sysfs_list(const char* path, cpu_set_t* set) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+  CPU_ZERO(set);
+  int ok = 0;
+  unsigned lo, hi;
+  while (fscanf(f, "%u", &lo) == 1) {
+    hi = lo;
+    int c = fgetc(f);
+    if (c == '-') {
+      if (fscanf(f, "%u", &hi) != 1) {
+        break;
+      }
+      c = fgetc(f);
+    }
+    for (unsigned i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+      CPU_SET(i, set);
+    }
+    ok = 1;
+    if (c != ',') {
+      break;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+int pin_to_node(size_t index) {
+  cpu_set_t nodes;
+  if (!read_sysfs_list("/sys/devices/system/node/online", &nodes) || CPU_COUNT(&nodes) < 2) {
+    return 0;
+  }
+  // node numbers needn't be contiguous, so pick the index'th one that's online
+  size_t skip = index % CPU_COUNT(&nodes);
+  unsigned node = 0;
+  while (!CPU_ISSET(node, &nodes) || skip--) {
+    node++;
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+  cpu_set_t cpus, allowed;
+  if (!read_sysfs_list(path, &cpus) || sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    return 0;
+  }
+  // stay within whatever the process was already confined to
+  CPU_AND(&cpus, &cpus, &allowed);
+  if (!CPU_COUNT(&cpus)) {
+    return 0;
+  }
+  return !pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+void large_free(void* ptr, size_t size, int flags) {
+  if (!flags) {
+    free(ptr);
+    return;
+  }
+  if (ptr) {
+    munmap(ptr, round_up_to_huge_page(size));
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+/**
+ * Allocation for the big, randomly-accessed buffers: match tables and whole
+ * input and output buffers. With large tables, the random probes into the
+ * table miss the TLB on nearly every lookup, so backing these with huge pages
+ * cuts out most of the page walks. And on multi-socket hosts, keeping a
+ * worker's buffers on its own NUMA node avoids cross-socket traffic.
+ */
+
+// back the allocation with 2 MB pages: explicitly reserved ones
+// (MAP_HUGETLB) if there are any, otherwise transparent huge pages
+#define ALLOC_HUGE_PAGES 1
+// place the allocation on the NUMA node of the calling thread
+#define ALLOC_LOCAL_NODE 2
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Allocates size zeroed bytes. The flags are best-effort: when huge pages or
+ * NUMA placement aren't available, this falls back to ordinary pages.
+ * With no flags, this is just calloc().
+ * Returns NULL on failure.
+ */
+void* large_alloc(size_t size, int flags);
+
+/**
+ * Grows or shrinks an allocation from large_alloc(), preserving its contents
+ * up to the smaller of the two sizes. The flags must be those it was
+ * allocated with. Like realloc(), a NULL ptr (with an oldsize of 0) just
+ * allocates. With no flags, this is just realloc() (and so doesn't zero the
+ * new space).
+ * Returns NULL on failure, in which case the old allocation is untouched.
+ */
+void* large_realloc(void* ptr, size_t oldsize, size_t newsize, int flags);
+
+/**
+ * Pins the calling thread to the CPUs of one NUMA node, picked round-robin by
+ * index, so that threads given consecutive indices are spread across nodes
+ * and what each then allocates with ALLOC_LOCAL_NODE stays local to it. This
+ * is best-effort: on single-node hosts, or when the node's CPUs can't be
+ * found, the thread is left where it is.
+ * Returns whether the thread was pinned.
+ */
+int pin_to_node(size_t index);
+
+/**
+ * Frees an allocation from large_alloc(). The size and flags must be those
+ * it was allocated with.
+ */
+void large_free(void* ptr, size_t size, int flags);
+
+#endif
@@ -0,0 +1,474 @@
+#include "archive.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "compressor_utils.h"
+#include "varint.h"
+
+typedef struct {
+  char** paths;
+  size_t numpaths;
+  size_t capacity;
+} pathlist_t;
+
+static int pathlist_push(pathlist_t* list, char* path) {
+  if (list->numpaths == list->capacity) {
+    size_t capacity = MAX(list->capacity * 2, (size_t) 64);
+    char** paths = realloc(list->paths, capacity * sizeof(char*));
+    CHECK(paths, "failed to grow path list");
+    list->paths = paths;
+    list->capacity = capacity;
+  }
+  list->paths[list->numpaths++] = path;
+  return 1;
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * Adds path to the list if it's a regular file, or everything under it if
+ * it's a directory. Directory contents are visited in name order, so the
+ * same tree always makes the same archive. Symlinks found while walking
+ * are skipped rather than followed.
+ */
+static int collect_paths(pathlist_t* list, const char* path, int toplevel) {
+  struct stat st;
+  CHECK(!(toplevel ? stat(path, &st) : lstat(path, &st)), "failed to stat input path");
+
+  if (S_ISREG(st.st_mode)) {
+    char* copy = strdup(path);
+    CHECK(copy, "failed to copy path");
+    return pathlist_push(list, copy);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    CHECK(!toplevel, "input path is neither a file nor a directory");
+    return 1;
+  }
+
+  DIR* dir = opendir(path);
+  CHECK(dir, "failed to open directory");
+  pathlist_t children = {NULL, 0, 0};
+  struct dirent* de;
+  int ret = 1;
+  while (ret && (de = readdir(dir))) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+      continue;
+    }
+    size_t pathlen = strlen(path);
+    int slash = pathlen && path[pathlen - 1] != '/';
+    char* child = malloc(pathlen + slash + strlen(de->d_name) + 1);
+    ret = child != NULL;
+    if (ret) {
+      sprintf(child, "%s%s%s", path, slash ? "/" : "", de->d_name);
+      ret = pathlist_push(&children, child);
+    }
+  }
+  closedir(dir);
+  if (!ret) {
+    fprintf(stderr, "Error: failed to list directory\n");
+  }
+
+  qsort(children.paths, children.numpaths, sizeof(char*), compare_names);
+  for (size_t i = 0; i < children.numpaths; i++) {
+    ret = ret && collect_paths(list, children.paths[i], 0);
+    free(children.paths[i]);
+  }
+  free(children.paths);
+  return ret;
+}
+
+enum {
+  SLOT_PENDING,
+  SLOT_DONE,
+  SLOT_FAILED
+};
+
+/**
+ * One file's worth of work. Filled in by whichever worker claims it.
+ */
+typedef struct {
+  const char* path;
+  byte_t* data;
+  size_t compressed_size;
+  size_t decompressed_size;
+  int state;
+} slot_t;
+
+typedef struct {
+  slot_t* slots;
+  size_t numslots;
+  // the next slot to claim, and how many have been written out
+  size_t next;
+  size_t written;
+  // how many workers have started, which numbers them for pin_to_node()
+  size_t numworkers;
+  // how far past the writer workers may get, so that a slow file doesn't let
+  // the compressed copies of everything after it pile up in memory
+  size_t maxahead;
+  int checksum;
+  int stop;
+  pthread_mutex_t lock;
+  // signalled when a slot is done, and when one has been written out
+  pthread_cond_t ready;
+  pthread_cond_t room;
+} pool_t;
+
+/**
+ * Reads a whole file into *buf, growing it as needed.
+ * Returns the number of bytes read, or (size_t) -1 on failure.
+ */
+static size_t read_file(const char* path, byte_t** buf, size_t* bufsize) {
+  int fd = open(path, O_RDONLY);
+  CHECKR(fd >= 0, "failed to open input file", (size_t) -1);
+  struct stat st;
+  size_t size = 0;
+  if (!fstat(fd, &st)) {
+    // one byte more than we expect, so we notice the file having grown
+    size_t want = st.st_size + 1;
+    for (;;) {
+      if (size == *bufsize) {
+        size_t newsize = MAX(want, *bufsize * 2);
+        byte_t* newbuf = large_realloc(*buf, *bufsize, newsize, ALLOC_LOCAL_NODE);
+        if (!newbuf) {
+          size = (size_t) -1;
+          break;
+        }
+        *buf = newbuf;
+        *bufsize = newsize;
+      }
+      ssize_t bytes_read = read(fd, *buf + size, *bufsize - size);
+      if (bytes_read <= 0) {
+        if (bytes_read < 0) {
+          size = (size_t) -1;
+        }
+        break;
+      }
+      size += bytes_read;
+    }
+  }
+  close(fd);
+  CHECKR(size != (size_t) -1, "failed to read input file", (size_t) -1);
+  return size;
+}
+
+/**
+ * Claims files one at a time and compresses each into its slot. Each worker
+ * has a single context and pair of buffers that it reuses for everything it
+ * compresses. Workers are pinned to NUMA nodes in turn before allocating
+ * them, so each one's allocations are local to the CPUs it runs on.
+ */
+static void* archive_worker(void* arg) {
+  pool_t* pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  size_t index = pool->numworkers++;
+  pthread_mutex_unlock(&pool->lock);
+  pin_to_node(index);
+
+  cctx_t* cctx = make_cctx_with_flags(TABLE_SIZE_LOG, ALLOC_LOCAL_NODE);
+  if (cctx) {
+    cctx->checksum = pool->checksum;
+  }
+  byte_t* ibuf = NULL;
+  size_t isize = 0;
+  byte_t* obuf = NULL;
+  size_t osize = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop && pool->next < pool->numslots && pool->next >= pool->written + pool->maxahead) {
+      pthread_cond_wait(&pool->room, &pool->lock);
+    }
+    size_t i = pool->stop ? pool->numslots : pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->numslots) {
+      break;
+    }
+    slot_t* slot = &pool->slots[i];
+
+    int ok = cctx != NULL;
+    size_t size = ok ? read_file(slot->path, &ibuf, &isize) : (size_t) -1;
+    ok = size != (size_t) -1;
+    if (ok && compressed_size_bound(size) > osize) {
+      size_t newsize = compressed_size_bound(size);
+      byte_t* newbuf = large_realloc(obuf, osize, newsize, ALLOC_LOCAL_NODE);
+      ok = newbuf != NULL;
+      if (ok) {
+        obuf = newbuf;
+        osize = newsize;
+      }
+    }
+    size_t csize = ok ? compress(cctx, obuf, osize, ibuf, size) : 0;
+    ok = csize != 0;
+    byte_t* data = ok ? malloc(csize) : NULL;
+    ok = data != NULL;
+    if (ok) {
+      memcpy(data, obuf, csize);
+    } else {
+      fprintf(stderr, "Error: failed to compress %s\n", slot->path);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    slot->data = data;
+    slot->compressed_size = csize;
+    slot->decompressed_size = size;
+    slot->state = ok ? SLOT_DONE : SLOT_FAILED;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  large_free(obuf, osize, ALLOC_LOCAL_NODE);
+  large_free(ibuf, isize, ALLOC_LOCAL_NODE);
+  if (cctx) {
+    free_cctx(cctx);
+  }
+  return NULL;
+}
+
+static void write_le64(byte_t* dst, uint64_t val) {
+  for (int i = 0; i < 8; i++) {
+    dst[i] = val >> (8 * i);
+  }
+}
+
+static uint64_t read_le64(const byte_t* src) {
+  uint64_t val = 0;
+  for (int i = 0; i < 8; i++) {
+    val |= ((uint64_t) src[i]) << (8 * i);
+  }
+  return val;
+}
+
+/**
+ * Writes the directory and trailer for the first numslots slots, which start
+ * at diroffset.
+ */
+static int write_directory(FILE* out, const slot_t* slots, size_t numslots, uint64_t diroffset) {
+  size_t dirsize = VARINT_MAX_SIZE + ARCHIVE_TRAILER_SIZE;
+  for (size_t i = 0; i < numslots; i++) {
+    dirsize += strlen(slots[i].path) + 4 * VARINT_MAX_SIZE;
+  }
+  byte_t* dir = malloc(dirsize);
+  CHECK(dir, "failed to allocate directory");
+
+  byte_t* dirp = dir;
+  byte_t* dirend = dir + dirsize;
+  uint64_t offset = ARCHIVE_MAGIC_SIZE;
+  int ok = varint_encode(&dirp, dirend - dirp, numslots);
+  for (size_t i = 0; ok && i < numslots; i++) {
+    size_t namelen = strlen(slots[i].path);
+    ok = varint_encode(&dirp, dirend - dirp, namelen);
+    memcpy(dirp, slots[i].path, namelen);
+    dirp += namelen;
+    ok = ok && varint_encode(&dirp, dirend - dirp, offset);
+    ok = ok && varint_encode(&dirp, dirend - dirp, slots[i].compressed_size);
+    ok = ok && varint_encode(&dirp, dirend - dirp, slots[i].decompressed_size);
+    offset += slots[i].compressed_size;
+  }
+  write_le64(dirp, diroffset);
+  memcpy(dirp + 8, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE);
+  dirp += ARCHIVE_TRAILER_SIZE;
+
+  ok = ok && fwrite(dir, 1, dirp - dir, out) == (size_t) (dirp - dir);
+  free(dir);
+  CHECK(ok, "failed to write directory");
+  return 1;
+}
+
+int archive_create(
+    FILE* out,
+    const char* const* paths, size_t numpaths,
+    size_t numthreads, int checksum) {
+  pathlist_t list = {NULL, 0, 0};
+  int ok = 1;
+  for (size_t i = 0; ok && i < numpaths; i++) {
+    ok = collect_paths(&list, paths[i], 1);
+  }
+
+  pool_t pool;
+  pool.slots = ok ? calloc(MAX(list.numpaths, (size_t) 1), sizeof(slot_t)) : NULL;
+  pool.numslots = list.numpaths;
+  pool.next = 0;
+  pool.written = 0;
+  pool.numworkers = 0;
+  pool.checksum = checksum;
+  pool.stop = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.ready, NULL);
+  pthread_cond_init(&pool.room, NULL);
+  ok = pool.slots != NULL;
+  for (size_t i = 0; ok && i < list.numpaths; i++) {
+    pool.slots[i].path = list.paths[i];
+  }
+
+  numthreads = MIN(MAX(numthreads, (size_t) 1), MAX(list.numpaths, (size_t) 1));
+  pool.maxahead = 2 * numthreads;
+  pthread_t* threads = ok ? malloc(numthreads * sizeof(pthread_t)) : NULL;
+  ok = threads != NULL;
+  size_t started = 0;
+  while (ok && started < numthreads) {
+    ok = !pthread_create(&threads[started], NULL, archive_worker, &pool);
+    started += ok;
+  }
+  if (!ok && started) {
+    // carry on with the workers we did get
+    ok = 1;
+  }
+
+  // write each file's message out as soon as it and all before it are done
+  uint64_t offset = ARCHIVE_MAGIC_SIZE;
+  ok = ok && fwrite(ARCHIVE_MAGIC, 1, ARCHIVE_MAGIC_SIZE, out) == ARCHIVE_MAGIC_SIZE;
+  for (size_t i = 0; ok && i < pool.numslots; i++) {
+    slot_t* slot = &pool.slots[i];
+    pthread_mutex_lock(&pool.lock);
+    while (slot->state == SLOT_PENDING) {
+      pthread_cond_wait(&pool.ready, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    ok = slot->state == SLOT_DONE &&
+        fwrite(slot->data, 1, slot->compressed_size, out) == slot->compressed_size;
+    offset += slot->compressed_size;
+    free(slot->data);
+    slot->data = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.written = i + 1;
+    pthread_cond_broadcast(&pool.room);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  if (!ok) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.room);
+    pthread_mutex_unlock(&pool.lock);
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  ok = ok && write_directory(out, pool.slots, pool.numslots, offset);
+
+  for (size_t i = 0; pool.slots && i < pool.numslots; i++) {
+    free(pool.slots[i].data);
+  }
+  for (size_t i = 0; i < list.numpaths; i++) {
+    free(list.paths[i]);
+  }
+  free(list.paths);
+  free(pool.slots);
+  free(threads);
+  pthread_cond_destroy(&pool.room);
+  pthread_cond_destroy(&pool.ready);
+  pthread_mutex_destroy(&pool.lock);
+
+  CHECK(ok, "failed to create archive");
+  return 1;
+}
+
+int archive_read_index(FILE* in, archive_index_t* index) {
+  index->entries = NULL;
+  index->numentries = 0;
+
+  byte_t trailer[ARCHIVE_TRAILER_SIZE];
+  CHECK(!fseeko(in, 0, SEEK_END), "archive isn't seekable");
+  off_t end = ftello(in);
+  CHECK(end >= ARCHIVE_MAGIC_SIZE + ARCHIVE_TRAILER_SIZE, "archive is too small");
+  CHECK(!fseeko(in, end - ARCHIVE_TRAILER_SIZE, SEEK_SET), "failed to seek to trailer");
+  CHECK(fread(trailer, 1, ARCHIVE_TRAILER_SIZE, in) == ARCHIVE_TRAILER_SIZE, "failed to read trailer");
+  CHECK(!memcmp(trailer + 8, ARCHIVE_MAGIC, ARCHIVE_MAGIC_SIZE), "not an archive");
+
+  uint64_t diroffset = read_le64(trailer);
+  CHECK(diroffset >= ARCHIVE_MAGIC_SIZE && diroffset <= (uint64_t) end - ARCHIVE_TRAILER_SIZE,
+      "corrupt directory offset");
+  size_t dirsize = end - ARCHIVE_TRAILER_SIZE - diroffset;
+  byte_t* dir = malloc(MAX(dirsize, (size_t) 1));
+  CHECK(dir, "failed to allocate directory");
+  int ok = !fseeko(in, diroffset, SEEK_SET) && fread(dir, 1, dirsize, in) == dirsize;
+
+  const byte_t* dirp = dir;
+  const byte_t* dirend = dir + dirsize;
+  uint64_t numentries = 0;
+  ok = ok && varint_decode(&dirp, dirend - dirp, &numentries);
+  // every entry takes at least 4 bytes, which bounds what we allocate
+  ok = ok && numentries <= dirsize / 4;
+  index->entries = ok ? calloc(MAX(numentries, (uint64_t) 1), sizeof(archive_entry_t)) : NULL;
+  ok = index->entries != NULL;
+  for (uint64_t i = 0; ok && i < numentries; i++) {
+    archive_entry_t* entry = &index->entries[i];
+    uint64_t namelen;
+    ok = varint_decode(&dirp, dirend - dirp, &namelen) && namelen <= (uint64_t) (dirend - dirp);
+    entry->name = ok ? malloc(namelen + 1) : NULL;
+    ok = entry->name != NULL;
+    if (ok) {
+      memcpy(entry->name, dirp, namelen);
+      entry->name[namelen] = '\0';
+      dirp += namelen;
+      index->numentries++;
+    }
+    ok = ok && varint_decode(&dirp, dirend - dirp, &entry->offset);
+    ok = ok && varint_decode(&dirp, dirend - dirp, &entry->compressed_size);
+    ok = ok && varint_decode(&dirp, dirend - dirp, &entry->decompressed_size);
+    ok = ok && entry->offset >= ARCHIVE_MAGIC_SIZE && entry->offset <= diroffset &&
+        entry->compressed_size <= diroffset - entry->offset;
+  }
+  ok = ok && dirp == dirend;
+  free(dir);
+
+  if (!ok) {
+    archive_free_index(index);
+  }
+  CHECK(ok, "corrupt archive directory");
+  return 1;
+}
+
+void archive_free_index(archive_index_t* index) {
+  for (size_t i = 0; i < index->numentries; i++) {
+    free(index->entries[i].name);
+  }
+  free(index->entries);
+  index->entries = NULL;
+  index->numentries = 0;
+}
+
+const archive_entry_t* archive_find(const archive_index_t* index, const char* name) {
+  for (size_t i = 0; i < index->numentries; i++) {
+    if (!strcmp(index->entries[i].name, name)) {
+      return &index->entries[i];
+    }
+  }
+  return NULL;
+}
+
+int archive_extract(FILE* in, const archive_entry_t* entry, FILE* out) {
+  size_t csize = entry->compressed_size;
+  size_t size = entry->decompressed_size;
+  CHECK(csize == entry->compressed_size && size == entry->decompressed_size, "entry is too large");
+  CHECK(!fseeko(in, entry->offset, SEEK_SET), "failed to seek to entry");
+
+  byte_t* ibuf = malloc(MAX(csize, (size_t) 1));
+  CHECK(ibuf, "failed to allocate input buffer");
+  int ok = fread(ibuf, 1, csize, in) == csize && decompressed_size(ibuf, csize) == size;
+  byte_t* obuf = NULL;
+  if (ok && !size) {
+    // decompress() can't tell an empty message from a failure
+    ok = verify_empty_message(ibuf, csize, NULL, 0);
+  } else {
+    obuf = ok ? malloc(size) : NULL;
+    ok = obuf != NULL && decompress(obuf, size, ibuf, csize) == size;
+    ok = ok && fwrite(obuf, 1, size, out) == size;
+  }
+  free(obuf);
+  free(ibuf);
+  CHECK(ok, "failed to extract entry");
+  return 1;
+}
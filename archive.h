@@ -0,0 +1,94 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+
+#include "compressor.h"
+
+/**
+ * An archive holds many files, each compressed as an independent message
+ * (see compressor.h), followed by a central directory that says where each
+ * one is. Any one file can be extracted by reading the directory and seeking
+ * straight to it, without touching the others.
+ *
+ * The layout is:
+ *
+ *   byte[4] ARCHIVE_MAGIC,
+ *   byte[] messages, back to back,
+ *   directory,
+ *   byte[8] directory offset, little-endian,
+ *   byte[4] ARCHIVE_MAGIC
+ *
+ * where the directory is:
+ *
+ *   varint numentries,
+ *   entry[numentries]
+ *
+ * and each entry is:
+ *
+ *   varint namelen,
+ *   byte[namelen] name,
+ *   varint offset (of its message, from the start of the archive),
+ *   varint compressed size,
+ *   varint decompressed size
+ *
+ * Entries are in the same order as the messages.
+ */
+
+#define ARCHIVE_MAGIC "CARC"
+#define ARCHIVE_MAGIC_SIZE 4
+#define ARCHIVE_TRAILER_SIZE (8 + ARCHIVE_MAGIC_SIZE)
+
+typedef struct {
+  char* name;
+  uint64_t offset;
+  uint64_t compressed_size;
+  uint64_t decompressed_size;
+} archive_entry_t;
+
+typedef struct {
+  archive_entry_t* entries;
+  size_t numentries;
+} archive_index_t;
+
+/**
+ * Writes an archive of the given files to out. Directories are walked
+ * recursively, and every regular file in them is included.
+ *
+ * Files are read and compressed concurrently by numthreads workers, each of
+ * which reuses one compression context for all of the files it handles.
+ * Workers are spread across NUMA nodes, and each one's context and buffers
+ * are kept on its own node. Output is written in order as it becomes ready,
+ * so out doesn't need to be seekable. Workers stay at most 2 * numthreads
+ * files ahead of the writer, so memory use doesn't grow with the number of
+ * files.
+ * Returns whether successful.
+ */
+int archive_create(
+    FILE* out,
+    const char* const* paths, size_t numpaths,
+    size_t numthreads, int checksum);
+
+/**
+ * Reads the central directory of the archive in, which must be seekable.
+ * Returns whether successful.
+ */
+int archive_read_index(FILE* in, archive_index_t* index);
+
+/**
+ * Frees what archive_read_index() allocated.
+ */
+void archive_free_index(archive_index_t* index);
+
+/**
+ * Looks a file up by name. Returns NULL if it isn't in the archive.
+ */
+const archive_entry_t* archive_find(const archive_index_t* index, const char* name);
+
+/**
+ * Decompresses one file of the archive in to out.
+ * Returns whether successful.
+ */
+int archive_extract(FILE* in, const archive_entry_t* entry, FILE* out);
+
+#endif
@@ -0,0 +1,276 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#include "compressor_utils.h"
+
+static const uint64_t PRIME32_1 = 0x9E3779B1u;
+static const uint64_t PRIME32_2 = 0x85EBCA77u;
+static const uint64_t PRIME32_3 = 0xC2B2AE3Du;
+static const uint64_t PRIME64_1 = 11400714785074694791ull;
+static const uint64_t PRIME64_2 = 14029467366897019727ull;
+static const uint64_t PRIME64_3 = 1609587929392839161ull;
+static const uint64_t PRIME64_4 = 9650029242287828579ull;
+static const uint64_t PRIME64_5 = 2870177450012600261ull;
+static const uint64_t PRIME_MX1 = 0x165667919E3779F9ull;
+static const uint64_t PRIME_MX2 = 0x9FB21C651E98DF25ull;
+
+#define SECRET_SIZE 192
+// each stripe uses the secret starting 8 bytes further on than the last one,
+// until the accumulators are scrambled and it starts over
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - CHECKSUM_STRIPE_SIZE) / 8)
+// inputs up to this long are hashed without the accumulators
+#define SHORT_INPUT_MAX 240
+
+static const byte_t SECRET[SECRET_SIZE] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint64_t rotl64(uint64_t val, int bits) {
+  return (val << bits) | (val >> (64 - bits));
+}
+
+static inline uint64_t read64(const byte_t* p) {
+  uint64_t val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+static inline uint32_t read32(const byte_t* p) {
+  uint32_t val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+/**
+ * Multiplies out to 128 bits, and folds the halves together.
+ */
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+  unsigned __int128 product = (unsigned __int128) a * b;
+  return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+static inline uint64_t avalanche(uint64_t hash) {
+  hash ^= hash >> 37;
+  hash *= PRIME_MX1;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+static inline uint64_t rrmxmx(uint64_t hash, uint64_t size) {
+  hash ^= rotl64(hash, 49) ^ rotl64(hash, 24);
+  hash *= PRIME_MX2;
+  hash ^= (hash >> 35) + size;
+  hash *= PRIME_MX2;
+  hash ^= hash >> 28;
+  return hash;
+}
+
+static inline uint64_t mix16(const byte_t* buf, const byte_t* secret) {
+  return mul128_fold64(read64(buf) ^ read64(secret), read64(buf + 8) ^ read64(secret + 8));
+}
+
+/**
+ * Inputs of up to SHORT_INPUT_MAX bytes are hashed in one go, in one of a few
+ * ways depending on their size.
+ */
+static uint64_t checksum_short(const byte_t* buf, size_t size) {
+  if (size == 0) {
+    return xxh64_avalanche(read64(SECRET + 56) ^ read64(SECRET + 64));
+  }
+  if (size <= 3) {
+    uint32_t combined = ((uint32_t) buf[0] << 16) | ((uint32_t) buf[size >> 1] << 24) |
+        (uint32_t) buf[size - 1] | ((uint32_t) size << 8);
+    return xxh64_avalanche(combined ^ (uint64_t) (read32(SECRET) ^ read32(SECRET + 4)));
+  }
+  if (size <= 8) {
+    uint64_t input = read32(buf + size - 4) + ((uint64_t) read32(buf) << 32);
+    return rrmxmx(input ^ (read64(SECRET + 8) ^ read64(SECRET + 16)), size);
+  }
+  if (size <= 16) {
+    uint64_t lo = read64(buf) ^ (read64(SECRET + 24) ^ read64(SECRET + 32));
+    uint64_t hi = read64(buf + size - 8) ^ (read64(SECRET + 40) ^ read64(SECRET + 48));
+    return avalanche(size + __builtin_bswap64(lo) + hi + mul128_fold64(lo, hi));
+  }
+
+  uint64_t acc = size * PRIME64_1;
+  if (size <= 128) {
+    // pairs of 16 byte reads from either end, working inwards
+    for (size_t i = 0; i < 4 && (i == 0 || size > 32 * i); i++) {
+      acc += mix16(buf + 16 * i, SECRET + 32 * i);
+      acc += mix16(buf + size - 16 * (i + 1), SECRET + 32 * i + 16);
+    }
+    return avalanche(acc);
+  }
+
+  size_t numrounds = size / 16;
+  for (size_t i = 0; i < 8; i++) {
+    acc += mix16(buf + 16 * i, SECRET + 16 * i);
+  }
+  acc = avalanche(acc);
+  for (size_t i = 8; i < numrounds; i++) {
+    acc += mix16(buf + 16 * i, SECRET + 16 * (i - 8) + 3);
+  }
+  acc += mix16(buf + size - 16, SECRET + 136 - 17);
+  return avalanche(acc);
+}
+
+/**
+ * Adds one stripe to the accumulators. Each of the eight lanes takes a
+ * 32x32->64 bit product and a plain add, and nothing in a stripe depends on
+ * another lane's result from the same stripe, so this maps straight onto
+ * vector multiplies of 32-bit halves (pmuludq), which are cheap on every
+ * x86-64 target.
+ */
+static inline void accumulate_stripe(uint64_t* acc, const byte_t* buf, const byte_t* secret) {
+  for (int i = 0; i < 8; i++) {
+    uint64_t data = read64(buf + 8 * i);
+    uint64_t key = data ^ read64(secret + 8 * i);
+    acc[i ^ 1] += data;
+    acc[i] += (key & 0xFFFFFFFFu) * (key >> 32);
+  }
+}
+
+static inline void scramble(uint64_t* acc, const byte_t* secret) {
+  for (int i = 0; i < 8; i++) {
+    uint64_t val = acc[i];
+    val ^= val >> 47;
+    val ^= read64(secret + 8 * i);
+    acc[i] = val * PRIME32_1;
+  }
+}
+
+/**
+ * Consumes count whole stripes, scrambling the accumulators at the end of
+ * every block. This is where long inputs spend nearly all of their time.
+ */
+MULTIVERSION
+static void checksum_stripes(uint64_t* acc, size_t* numstripes, const byte_t* buf, size_t count) {
+  uint64_t lanes[8];
+  memcpy(lanes, acc, sizeof(lanes));
+  while (count) {
+    size_t blockstripes = MIN(count, STRIPES_PER_BLOCK - *numstripes);
+    const byte_t* secret = SECRET + *numstripes * 8;
+    for (size_t i = 0; i < blockstripes; i++) {
+      accumulate_stripe(lanes, buf + i * CHECKSUM_STRIPE_SIZE, secret + i * 8);
+    }
+    buf += blockstripes * CHECKSUM_STRIPE_SIZE;
+    count -= blockstripes;
+    *numstripes += blockstripes;
+    if (*numstripes == STRIPES_PER_BLOCK) {
+      scramble(lanes, SECRET + SECRET_SIZE - CHECKSUM_STRIPE_SIZE);
+      *numstripes = 0;
+    }
+  }
+  memcpy(acc, lanes, sizeof(lanes));
+}
+
+void checksum_init(checksum_t* state) {
+  state->acc[0] = PRIME32_3;
+  state->acc[1] = PRIME64_1;
+  state->acc[2] = PRIME64_2;
+  state->acc[3] = PRIME64_3;
+  state->acc[4] = PRIME64_4;
+  state->acc[5] = PRIME32_2;
+  state->acc[6] = PRIME64_5;
+  state->acc[7] = PRIME32_1;
+  state->totalsize = 0;
+  state->numstripes = 0;
+  state->bufsize = 0;
+}
+
+void checksum_update(checksum_t* state, const byte_t* buf, size_t size) {
+  state->totalsize += size;
+
+  if (size <= CHECKSUM_BUFFER_SIZE - state->bufsize) {
+    memcpy(state->buf + state->bufsize, buf, size);
+    state->bufsize += size;
+    return;
+  }
+
+  // there's more coming than fits, so whatever is buffered can be consumed.
+  // Input is only ever consumed when more follows it, though, so that the
+  // digest always has the last stripe to hand.
+  if (state->bufsize) {
+    size_t fill = CHECKSUM_BUFFER_SIZE - state->bufsize;
+    memcpy(state->buf + state->bufsize, buf, fill);
+    buf += fill;
+    size -= fill;
+    checksum_stripes(state->acc, &state->numstripes, state->buf, CHECKSUM_BUFFER_SIZE / CHECKSUM_STRIPE_SIZE);
+    state->bufsize = 0;
+  }
+
+  if (size > CHECKSUM_BUFFER_SIZE) {
+    size_t count = (size - 1) / CHECKSUM_STRIPE_SIZE;
+    checksum_stripes(state->acc, &state->numstripes, buf, count);
+    buf += count * CHECKSUM_STRIPE_SIZE;
+    size -= count * CHECKSUM_STRIPE_SIZE;
+    // keep the last stripe consumed at the end of the buffer, where the
+    // digest finds it if less than a stripe follows it
+    memcpy(state->buf + CHECKSUM_BUFFER_SIZE - CHECKSUM_STRIPE_SIZE, buf - CHECKSUM_STRIPE_SIZE,
+        CHECKSUM_STRIPE_SIZE);
+  }
+
+  memcpy(state->buf, buf, size);
+  state->bufsize = size;
+}
+
+uint64_t checksum_digest(const checksum_t* state) {
+  if (state->totalsize <= SHORT_INPUT_MAX) {
+    // it's all still in the buffer
+    return checksum_short(state->buf, state->totalsize);
+  }
+
+  uint64_t acc[8];
+  memcpy(acc, state->acc, sizeof(acc));
+  size_t numstripes = state->numstripes;
+  byte_t stripe[CHECKSUM_STRIPE_SIZE];
+  const byte_t* laststripe;
+  if (state->bufsize >= CHECKSUM_STRIPE_SIZE) {
+    checksum_stripes(acc, &numstripes, state->buf, (state->bufsize - 1) / CHECKSUM_STRIPE_SIZE);
+    laststripe = state->buf + state->bufsize - CHECKSUM_STRIPE_SIZE;
+  } else {
+    // the last stripe starts in the one consumed before the buffered bytes
+    size_t catchup = CHECKSUM_STRIPE_SIZE - state->bufsize;
+    memcpy(stripe, state->buf + CHECKSUM_BUFFER_SIZE - catchup, catchup);
+    memcpy(stripe + catchup, state->buf, state->bufsize);
+    laststripe = stripe;
+  }
+  accumulate_stripe(acc, laststripe, SECRET + SECRET_SIZE - CHECKSUM_STRIPE_SIZE - 7);
+
+  uint64_t hash = state->totalsize * PRIME64_1;
+  for (int i = 0; i < 4; i++) {
+    hash += mul128_fold64(acc[2 * i] ^ read64(SECRET + 11 + 16 * i), acc[2 * i + 1] ^ read64(SECRET + 11 + 16 * i + 8));
+  }
+  return avalanche(hash);
+}
+
+uint64_t checksum(const byte_t* buf, size_t size) {
+  if (size <= SHORT_INPUT_MAX) {
+    return checksum_short(buf, size);
+  }
+  checksum_t state;
+  checksum_init(&state);
+  checksum_update(&state, buf, size);
+  return checksum_digest(&state);
+}
@@ -0,0 +1,57 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "compressor.h"
+
+/**
+ * An implementation of the 64-bit XXH3 hash (with the default secret and a
+ * seed of 0), used to optionally checksum the decompressed contents of a
+ * message. See
+ * https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ *
+ * The state is incremental, so that the compressor and decompressor can feed
+ * it spans of content as they go, while those bytes are still in cache.
+ */
+
+#define CHECKSUM_STRIPE_SIZE 64
+
+// how much input the state holds on to between updates, which is enough to
+// hash short inputs in one go at the end, and to find the last stripe of
+// long ones
+#define CHECKSUM_BUFFER_SIZE 256
+
+// how far the compressor and decompressor let their cursors get ahead of the
+// checksum before feeding it the bytes in between
+#define CHECKSUM_SPAN (4 * 1024)
+
+typedef struct {
+  uint64_t acc[8];
+  uint64_t totalsize;
+  // stripes accumulated since the accumulators were last scrambled
+  size_t numstripes;
+  byte_t buf[CHECKSUM_BUFFER_SIZE];
+  size_t bufsize;
+} checksum_t;
+
+/**
+ * Resets a checksum state.
+ */
+void checksum_init(checksum_t* state);
+
+/**
+ * Adds size bytes of content to the checksum.
+ */
+void checksum_update(checksum_t* state, const byte_t* buf, size_t size);
+
+/**
+ * Returns the hash of all of the content added so far. Doesn't modify the
+ * state.
+ */
+uint64_t checksum_digest(const checksum_t* state);
+
+/**
+ * One-shot hash of a buffer.
+ */
+uint64_t checksum(const byte_t* buf, size_t size);
+
+#endif
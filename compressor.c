@@ -3,69 +3,246 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc.h"
+#include "checksum.h"
 #include "compressor_utils.h"
 #include "varint.h"
 
+// positions are stored in the table offset by tableoffset; start over with
+// an empty table long before that could overflow
+#define MAX_TABLE_OFFSET (SIZE_MAX / 2)
+
 cctx_t* make_cctx(void) {
-  cctx_t* cctx = malloc(sizeof(cctx_t));
+  return make_cctx_sized(TABLE_SIZE_LOG);
+}
+
+cctx_t* make_cctx_sized(unsigned tablelog) {
+  return make_cctx_with_flags(tablelog, 0);
+}
+
+cctx_t* make_cctx_with_flags(unsigned tablelog, int allocflags) {
+  CHECK(tablelog >= 1 && tablelog <= MAX_TABLE_SIZE_LOG, "table size out of range");
+  cctx_t* cctx = calloc(1, sizeof(cctx_t));
   CHECK(cctx, "couldn't allocate cctx");
-  cctx->tablesize = 1 << TABLE_SIZE_LOG;
-  cctx->table = calloc(cctx->tablesize, sizeof(size_t));
-  CHECK(cctx->table, "couldn't allocate cctx table");
+  cctx->tablelog = tablelog;
+  cctx->tablesize = (size_t) 1 << tablelog;
+  cctx->allocflags = allocflags;
+  cctx->table = NULL;
   // start offset at 1 so we can distinguish table lookup misses from valid
   // references to the first byte of the source
   cctx->tableoffset = 1;
+  cctx->checksum = 0;
+  cctx->acceleration = 1;
+  cctx->ref = NULL;
+  cctx->refsize = 0;
+  cctx->numsmalltouched = 0;
   return cctx;
 }
 
+/**
+ * Allocates the table if this is the first time it's needed.
+ */
+static int ensure_table(cctx_t* cctx) {
+  if (likely(cctx->table != NULL)) {
+    return 1;
+  }
+  cctx->table = large_alloc(cctx->tablesize * sizeof(size_t), cctx->allocflags);
+  CHECK(cctx->table, "couldn't allocate cctx table");
+  return 1;
+}
+
 int free_cctx(cctx_t* cctx) {
-  free(cctx->table);
+  large_free(cctx->table, cctx->tablesize * sizeof(size_t), cctx->allocflags);
   free(cctx);
   return 1;
 }
 
 size_t compressed_size_bound(size_t srcsize) {
   // wild guess
-  return srcsize * 4 + 8;
+  return srcsize * 4 + 8 + CHECKSUM_SIZE;
+}
+
+size_t decompress_inplace_margin(size_t decompressed_size) {
+  // the header, plus the length of a final run of literals, which is at most
+  // the whole decompressed size
+  return varint_size((uint64_t) decompressed_size << HEADER_FLAG_BITS) +
+      varint_size(decompressed_size) + CHECKSUM_SIZE;
 }
 
 size_t decompressed_size(const byte_t* src, size_t srcsize) {
   uint64_t val;
-  CHECK(varint_decode(&src, srcsize, &val), "couldn't decode decompressed size");
+  unsigned flags;
+  CHECK(decode_header(&src, srcsize, &val, &flags), "couldn't decode decompressed size");
   return val;
 }
 
-static inline hash_t hash_position(const byte_t* srcp) {
+static inline hash_t hash_position(const byte_t* srcp, unsigned tablelog) {
   // Multiply by large prime (stolen from LZ4) to permute 32 bit input to
   // "random" 32 bit intermediate value. Right shift to map value into
   // hashtable's domain.
-  return (*((uint32_t*) srcp) * 2654435761u) >> (sizeof(uint32_t) * 8 - TABLE_SIZE_LOG);
+  return (*((uint32_t*) srcp) * 2654435761u) >> (sizeof(uint32_t) * 8 - tablelog);
 }
 
-static inline void put_match_for_hash(
-    cctx_t* cctx, const byte_t* pos, const byte_t* base, hash_t hash) {
-  cctx->table[hash] = pos - base + cctx->tableoffset;
+/**
+ * Table entries are positions in a virtual buffer made of the reference (if
+ * any) followed by the source. That is, positions below refsize are in the
+ * reference, and the rest are refsize past their position in the source.
+ */
+static inline void put_match_for_hash(cctx_t* cctx, size_t pos, hash_t hash) {
+  cctx->table[hash] = pos + cctx->tableoffset;
 }
 
-static inline const byte_t* get_match_for_hash(cctx_t* cctx, const byte_t* base, hash_t hash) {
+static inline int get_match_for_hash(cctx_t* cctx, hash_t hash, size_t* pos) {
   size_t offset = cctx->table[hash];
   if (offset < cctx->tableoffset) {
-    return NULL;
+    return 0;
   }
-  return base + offset - cctx->tableoffset;
+  *pos = offset - cctx->tableoffset;
+  return 1;
 }
 
-size_t compress(
+int cctx_load_reference(cctx_t* cctx, const byte_t* ref, size_t refsize) {
+  CHECK(ensure_table(cctx), "couldn't load reference");
+  cctx->ref = ref;
+  cctx->refsize = refsize;
+  if (refsize < 4) {
+    // too small to hash, matches can't start in it
+    return 1;
+  }
+
+  // Rather than inserting every position of a reference that may be far
+  // bigger than the table, insert about one position per table entry. Any
+  // region the source shares with the reference that's longer than the
+  // stride still gets found, since the source is hashed at every position and
+  // matches are extended backwards from wherever they're found.
+  const size_t stride = MAX(refsize >> cctx->tablelog, (size_t) 1);
+  const byte_t* refend = ref + refsize;
+  for (const byte_t* refp = ref; refp < refend - 4; refp += stride) {
+    put_match_for_hash(cctx, refp - ref, hash_position(refp, cctx->tablelog));
+  }
+  return 1;
+}
+
+int lambuf_push(
+    lambuf_t* lams,
+    uint64_t literal_length, const byte_t* literals,
+    uint64_t match_offset, uint64_t match_length) {
+  if (unlikely(lams->numlams == lams->capacity)) {
+    if (!lams->growable) {
+      return 0;
+    }
+    size_t capacity = MAX(lams->capacity * 2, (size_t) 64);
+    litandmatch_t* grown = realloc(lams->lams, capacity * sizeof(litandmatch_t));
+    CHECK(grown, "couldn't grow sequence buffer");
+    lams->lams = grown;
+    lams->capacity = capacity;
+  }
+  litandmatch_t* lam = lams->lams + lams->numlams++;
+  lam->literal_length = literal_length;
+  lam->literals = literals;
+  lam->match_offset = match_offset;
+  lam->match_length = match_length;
+  return 1;
+}
+
+/**
+ * Emits one sequence: into lams if it's set, otherwise encoded into dst at
+ * *dstp. A matchlen of 0 is the final run of literals, with its match
+ * elided. Otherwise the match also has to make up for what its sequence
+ * costs to encode, which is what lets messages be decompressed in place (see
+ * decompress_inplace_margin()); *used says whether it did and so was
+ * emitted. A match that isn't can be folded into the next sequence's
+ * literals instead.
+ * Returns whether successful.
+ */
+static inline int emit_sequence(
+    byte_t** dstp, byte_t* dstend, lambuf_t* lams,
+    const byte_t* literals, uint64_t litlen,
+    uint64_t matchoff, uint64_t matchlen,
+    int* used) {
+  *used = !matchlen || matchlen >= varint_size(litlen) + varint_size(matchoff) + varint_size(matchlen);
+  if (!*used) {
+    return 1;
+  }
+  if (lams) {
+    CHECK(lambuf_push(lams, litlen, literals, matchoff, matchlen), "sequence buffer full");
+    return 1;
+  }
+  CHECK(varint_encode(dstp, dstend - *dstp, litlen), "couldn't encode litlen");
+  CHECK(litlen <= (uint64_t) (dstend - *dstp), "literal too big for destination buffer");
+  memcpy(*dstp, literals, litlen);
+  *dstp += litlen;
+  if (matchlen) {
+    CHECK(varint_encode(dstp, dstend - *dstp, matchoff), "couldn't encode matchoff");
+    CHECK(varint_encode(dstp, dstend - *dstp, matchlen), "couldn't encode matchlen");
+  }
+  return 1;
+}
+
+/**
+ * Allows re-using the cctx without memsetting the table: moves the offset
+ * past every position a call over size bytes (of reference and source) could
+ * have stored, which it has to do whether or not the call succeeded.
+ */
+static void advance_table_offset(cctx_t* cctx, size_t size) {
+  cctx->tableoffset += size;
+  if (unlikely(cctx->tableoffset > MAX_TABLE_OFFSET)) {
+    if (cctx->table) {
+      memset(cctx->table, 0, cctx->tablesize * sizeof(size_t));
+    }
+    cctx->tableoffset = 1;
+  }
+}
+
+/**
+ * The match finder. Normally this encodes what it finds into dst as it goes.
+ * If lams is set, it instead stores the sequences it finds in lams, and
+ * doesn't touch dst.
+ */
+MULTIVERSION
+static size_t compress_impl(
     cctx_t* cctx,
     byte_t* dst, size_t dstsize,
-    const byte_t* src, size_t srcsize) {
+    const byte_t* src, size_t srcsize,
+    lambuf_t* lams) {
   const byte_t* srcp = src;
   const byte_t* srcend = src + srcsize;
   byte_t* dstend = dst + dstsize;
   byte_t* dstp = dst;
 
-  // write uncompressed size header
-  CHECK(varint_encode(&dstp, dstend - dstp, srcsize), "counldn't encode decompressed size");
+  // the reference is only good for this call
+  const byte_t* ref = cctx->ref;
+  const size_t refsize = cctx->refsize;
+  cctx->ref = NULL;
+  cctx->refsize = 0;
+
+  CHECK(ensure_table(cctx), "couldn't set up match finder");
+  const unsigned tablelog = cctx->tablelog;
+
+  unsigned flags = 0;
+  if (lams) {
+    // sequences are handed back as-is, with no header or checksum
+    lams->numlams = 0;
+  } else {
+    // write uncompressed size header
+    if (cctx->checksum) {
+      flags |= HEADER_FLAG_CHECKSUM;
+    }
+    if (refsize) {
+      flags |= HEADER_FLAG_REFERENCE;
+    }
+    CHECK(encode_header(&dstp, dstend - dstp, srcsize, flags), "counldn't encode decompressed size");
+  }
+
+  // rather than making a second pass over the input, the checksum is fed the
+  // source in spans of about CHECKSUM_SPAN bytes as the match finder moves
+  // past them, while they're still in cache. srcchecked is the point up to
+  // which it has been fed.
+  checksum_t checksumstate;
+  const byte_t* srcchecked = src;
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    checksum_init(&checksumstate);
+  }
 
   // srclitstart keeps track of the point in the stream we've actually encoded
   // up to in the compressed stream. That is, it is the point at which we will
@@ -73,43 +250,54 @@ size_t compress(
   // of the stream.
   const byte_t* srclitstart = srcp;
 
+  // how far past a position without a match to skip ahead
+  const size_t skip = cctx->acceleration > 1 ? cctx->acceleration - 1 : 0;
+
   // hash_position reads 4 bytes, make sure we don't run off the end of the
   // buffer
   for (; srcp < srcend - 4; srcp++) {
     // hash the bytes at the current position
-    hash_t hash = hash_position(srcp);
+    hash_t hash = hash_position(srcp, tablelog);
     // check whether a previous location in the stream had the same hash
-    const byte_t* srcmatch = get_match_for_hash(cctx, src, hash);
-    if (srcmatch >= src) {
-      // we found a hash match
+    size_t matchpos;
+    if (get_match_for_hash(cctx, hash, &matchpos) && matchpos < refsize + (srcp - src)) {
+      // we found a hash match, find it in either the reference or the source
+      const int inref = matchpos < refsize;
+      const byte_t* matchbase = inref ? ref : src;
+      const byte_t* matchlimit = inref ? ref + refsize : srcp;
+      const byte_t* srcmatch = inref ? ref + matchpos : src + (matchpos - refsize);
 
       // check that the bytes actually match, and expand the match forward
       // until they don't
       size_t matchlen = 0;
-      while (srcp + matchlen < srcend && srcmatch + matchlen < srcp && srcmatch[matchlen] == srcp[matchlen]) {
+      while (srcp + matchlen < srcend && srcmatch + matchlen < matchlimit && srcmatch[matchlen] == srcp[matchlen]) {
         matchlen++;
       }
       // expand the match backward
       const byte_t* oldsrcp = srcp;
-      while (srcp > srclitstart && srcp > srcmatch + matchlen && srcmatch > src && *(srcmatch - 1) == *(srcp - 1)) {
+      while (srcp > srclitstart && (inref || srcp > srcmatch + matchlen) && srcmatch > matchbase && *(srcmatch - 1) == *(srcp - 1)) {
         srcp--;
         srcmatch--;
         matchlen++;
       }
+      size_t litlen = srcp - srclitstart;
+      // the distance back from the current position to the end of the
+      // match, across the end of the reference if the match is in it
+      size_t matchoff = inref ? refsize - (srcmatch - ref) - matchlen + (srcp - src) : srcp - srcmatch - matchlen;
+      // if the match is long enough, use it
+      int used = 0;
       if (matchlen > MIN_MATCH) {
+        CHECK(emit_sequence(&dstp, dstend, lams, srclitstart, litlen, matchoff, matchlen, &used),
+            "couldn't emit sequence");
+      }
+      if (used) {
         // print_match_with_context(stderr, src, srcend, srcp, srcmatch, matchlen);
-
-        // if the match is long enough, use it
-        size_t litlen = srcp - srclitstart;
-        CHECK(varint_encode(&dstp, dstend - dstp, litlen), "couldn't encode litlen");
-        CHECK(dstp + litlen <= dstend, "literal too big for destination buffer");
-        memcpy(dstp, srclitstart, litlen);
-        dstp += litlen;
-        size_t matchoff = srcp - srcmatch - matchlen;
-        CHECK(varint_encode(&dstp, dstend - dstp, matchoff), "couldn't encode matchoff");
-        CHECK(varint_encode(&dstp, dstend - dstp, matchlen), "couldn't encode matchlen");
         srcp += matchlen - 1;
         srclitstart = srcp + 1;
+        if ((flags & HEADER_FLAG_CHECKSUM) && srclitstart - srcchecked >= CHECKSUM_SPAN) {
+          checksum_update(&checksumstate, srcchecked, srclitstart - srcchecked);
+          srcchecked = srclitstart;
+        }
       } else {
         // otherwise, abandon it (rewind may have moved srcp backwards)
         srcp = oldsrcp;
@@ -117,27 +305,275 @@ size_t compress(
     }
 
     // record this position's hash
-    put_match_for_hash(cctx, srcp, src, hash);
+    put_match_for_hash(cctx, refsize + (srcp - src), hash);
+
+    if (srclitstart <= srcp) {
+      // we didn't use a match here, skip ahead (without leaving the buffer)
+      srcp += MIN((size_t) (srcend - 4 - srcp), skip);
+    }
   }
 
   CHECK(srcp <= srcend, "ran past end of source buffer");
 
   if (srclitstart != srcend) {
     // encode final literals
-    size_t litlen = srcend - srclitstart;
-    CHECK(varint_encode(&dstp, dstend - dstp, litlen), "couldn't encode litlen");
-    CHECK(dstp + litlen <= dstend, "literal too big for destination buffer");
-    memcpy(dstp, srclitstart, litlen);
-    dstp += litlen;
+    int used;
+    CHECK(emit_sequence(&dstp, dstend, lams, srclitstart, srcend - srclitstart, 0, 0, &used),
+        "couldn't emit final literals");
   }
 
-  // allows re-using the cctx without memsetting the table
-  cctx->tableoffset += dstp - dst;
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    checksum_update(&checksumstate, srcchecked, srcend - srcchecked);
+    CHECK(dstend - dstp >= CHECKSUM_SIZE, "checksum too big for destination buffer");
+    write_checksum(dstp, checksum_digest(&checksumstate));
+    dstp += CHECKSUM_SIZE;
+  }
+
+  if (lams) {
+    return 1;
+  }
 
   // return the size of the compressed blob
   return dstp - dst;
 }
 
+/**
+ * The match finder for small inputs without a reference. It works the same
+ * way as compress_impl(), but with a table of 16-bit positions sized to the
+ * input, which stays in L1 and only needs as many bits of hash as it has
+ * entries. Rather than relying on tableoffset, the entries the previous call
+ * filled in are cleared at the start, so setup costs about as much as the
+ * last input was long.
+ */
+MULTIVERSION
+static size_t compress_small_impl(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize,
+    lambuf_t* lams) {
+  const byte_t* srcp = src;
+  const byte_t* srcend = src + srcsize;
+  byte_t* dstend = dst + dstsize;
+  byte_t* dstp = dst;
+
+  // an empty reference is used up like any other
+  cctx->ref = NULL;
+
+  // sparse enough that positions rarely collide: about 8 entries per
+  // position, which is as many hash bits as there's any use for
+  unsigned tablelog = SMALL_TABLE_SIZE_LOG_MIN;
+  while (tablelog < SMALL_TABLE_SIZE_LOG && ((size_t) 1 << tablelog) < srcsize * 8) {
+    tablelog++;
+  }
+  uint16_t* table = cctx->smalltable;
+  uint16_t* touched = cctx->smalltouched;
+  for (size_t i = 0; i < cctx->numsmalltouched; i++) {
+    table[touched[i]] = 0;
+  }
+  // counted in the cctx as entries are claimed, so that a call that gives up
+  // partway through still leaves them to be cleared by the next one
+  cctx->numsmalltouched = 0;
+
+  unsigned flags = 0;
+  if (lams) {
+    lams->numlams = 0;
+  } else {
+    if (cctx->checksum) {
+      flags |= HEADER_FLAG_CHECKSUM;
+    }
+    CHECK(encode_header(&dstp, dstend - dstp, srcsize, flags), "couldn't encode decompressed size");
+  }
+
+  const byte_t* srclitstart = srcp;
+  const size_t skip = cctx->acceleration > 1 ? cctx->acceleration - 1 : 0;
+
+  for (; srcp < srcend - 4; srcp++) {
+    hash_t hash = hash_position(srcp, tablelog);
+    const byte_t* hashed = srcp;
+    size_t entry = table[hash];
+    if (!entry) {
+      touched[cctx->numsmalltouched++] = hash;
+    } else {
+      const byte_t* srcmatch = src + entry - 1;
+
+      size_t matchlen = 0;
+      while (srcp + matchlen < srcend && srcmatch + matchlen < srcp && srcmatch[matchlen] == srcp[matchlen]) {
+        matchlen++;
+      }
+      while (srcp > srclitstart && srcp > srcmatch + matchlen && srcmatch > src && *(srcmatch - 1) == *(srcp - 1)) {
+        srcp--;
+        srcmatch--;
+        matchlen++;
+      }
+      size_t litlen = srcp - srclitstart;
+      size_t matchoff = srcp - srcmatch - matchlen;
+      int used = 0;
+      if (matchlen > MIN_MATCH) {
+        CHECK(emit_sequence(&dstp, dstend, lams, srclitstart, litlen, matchoff, matchlen, &used),
+            "couldn't emit sequence");
+      }
+      if (used) {
+        srcp += matchlen - 1;
+        srclitstart = srcp + 1;
+      } else {
+        srcp = hashed;
+      }
+    }
+
+    table[hash] = hashed - src + 1;
+
+    if (srclitstart <= srcp) {
+      srcp += MIN((size_t) (srcend - 4 - srcp), skip);
+    }
+  }
+
+  if (srclitstart < srcend) {
+    int used;
+    CHECK(emit_sequence(&dstp, dstend, lams, srclitstart, srcend - srclitstart, 0, 0, &used),
+        "couldn't emit final literals");
+  }
+
+  if (lams) {
+    return 1;
+  }
+
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    CHECK(dstend - dstp >= CHECKSUM_SIZE, "checksum too big for destination buffer");
+    write_checksum(dstp, checksum(src, srcsize));
+    dstp += CHECKSUM_SIZE;
+  }
+
+  return dstp - dst;
+}
+
+/**
+ * Picks the match finder for an input.
+ */
+static size_t compress_dispatch(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize,
+    lambuf_t* lams) {
+  if (srcsize <= SMALL_INPUT_MAX && !cctx->refsize) {
+    return compress_small_impl(cctx, dst, dstsize, src, srcsize, lams);
+  }
+  // compress_impl() uses up the reference, so take its size first
+  const size_t refsize = cctx->refsize;
+  size_t result = compress_impl(cctx, dst, dstsize, src, srcsize, lams);
+  advance_table_offset(cctx, refsize + srcsize);
+  return result;
+}
+
+size_t compress(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize) {
+  return compress_dispatch(cctx, dst, dstsize, src, srcsize, NULL);
+}
+
+int find_sequences(
+    cctx_t* cctx,
+    lambuf_t* lams,
+    const byte_t* src, size_t srcsize) {
+  return compress_dispatch(cctx, NULL, 0, src, srcsize, lams) != 0;
+}
+
+size_t compress_sequences(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize,
+    const litandmatch_t* lams, size_t numlams) {
+  const litandmatch_t* lamsend = lams + numlams;
+  byte_t* dstend = dst + dstsize;
+  byte_t* dstp = dst;
+
+  const size_t refsize = cctx->refsize;
+  cctx->ref = NULL;
+  cctx->refsize = 0;
+
+  unsigned flags = 0;
+  if (cctx->checksum) {
+    flags |= HEADER_FLAG_CHECKSUM;
+  }
+  if (refsize) {
+    flags |= HEADER_FLAG_REFERENCE;
+  }
+  CHECK(encode_header(&dstp, dstend - dstp, srcsize, flags), "couldn't encode decompressed size");
+
+  checksum_t checksumstate;
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    checksum_init(&checksumstate);
+  }
+
+  // how much of src the sequences so far cover, and where the literals not
+  // yet encoded start
+  size_t pos = 0;
+  size_t litstart = 0;
+  for (const litandmatch_t* lam = lams; lam < lamsend; lam++) {
+    uint64_t litlen = lam->literal_length;
+    uint64_t matchoff = lam->match_offset;
+    uint64_t matchlen = lam->match_length;
+    CHECK(litlen <= srcsize - pos, "sequence literals extend past end of source");
+    pos += litlen;
+
+    if (lam + 1 == lamsend && !matchlen && !matchoff) {
+      // elide the final match
+      break;
+    }
+    CHECK(matchlen <= srcsize - pos, "sequence match extends past end of source");
+    CHECK(matchoff <= refsize + pos && matchlen <= refsize + pos - matchoff,
+        "sequence match starts before beginning of input");
+    // a match that doesn't pay for its sequence is folded into the literals
+    // of the next one instead, like compress() does, so that the result can
+    // be decompressed in place
+    int used = 0;
+    if (matchlen) {
+      CHECK(emit_sequence(&dstp, dstend, NULL, src + litstart, pos - litstart, matchoff, matchlen, &used),
+          "couldn't emit sequence");
+    }
+    if (used) {
+      litstart = pos + matchlen;
+    }
+    pos += matchlen;
+  }
+  CHECK(pos == srcsize, "sequences don't cover the whole source");
+
+  if (litstart != srcsize) {
+    // encode final literals
+    int used;
+    CHECK(emit_sequence(&dstp, dstend, NULL, src + litstart, srcsize - litstart, 0, 0, &used),
+        "couldn't emit final literals");
+  }
+
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    checksum_update(&checksumstate, src, srcsize);
+    CHECK(dstend - dstp >= CHECKSUM_SIZE, "checksum too big for destination buffer");
+    write_checksum(dstp, checksum_digest(&checksumstate));
+    dstp += CHECKSUM_SIZE;
+  }
+
+  return dstp - dst;
+}
+
+size_t compress_batch(
+    cctx_t* cctx,
+    batchitem_t* items, size_t numitems) {
+  batchitem_t* itemsend = items + numitems;
+  size_t numsucceeded = 0;
+  for (batchitem_t* item = items; item < itemsend; item++) {
+    if (item + 1 < itemsend) {
+      // records are typically scattered in memory; start pulling the next
+      // one in while we work on this one
+      __builtin_prefetch(item[1].src);
+    }
+    // each item is an independent message; a failure is recorded in the
+    // item and doesn't stop the rest of the batch
+    item->result = compress_dispatch(cctx, item->dst, item->dstsize, item->src, item->srcsize, NULL);
+    numsucceeded += item->result != 0;
+  }
+  return numsucceeded;
+}
+
 /**
  * Decompression is very simple. In a loop, we:
  * 1. decode literal length
@@ -148,24 +584,54 @@ size_t compress(
  * 5. go back offset+length bytes in /dst/ and copy length bytes to the head
  *    of dst
  * 6. advance dst's cursor by length bytes
+ *
+ * If the message carries a checksum, the output is fed to it in spans as it
+ * is produced, and compared against the trailer at the end.
+ *
+ * If there is a reference, it is treated as though it immediately preceded
+ * dst, so that going back from the head of dst can land in the reference.
+ *
+ * If inplace is set, src is the tail of dst. Literals are copied with
+ * memmove() either way, and then all that's needed is to make sure no match
+ * writes past the input we've read so far.
+ *
+ * Returns whether successful, with the decompressed size in *decodedsize, so
+ * that an empty message can be told apart from a failure.
  */
-size_t decompress(
+MULTIVERSION
+static int decompress_impl(
     byte_t* dst, size_t dstsize,
-    const byte_t* src, size_t srcsize) {
+    const byte_t* src, size_t srcsize,
+    const byte_t* ref, size_t refsize,
+    int inplace, size_t* decodedsize) {
   const byte_t* srcp = src;
   const byte_t* srcend = src + srcsize;
   byte_t* dstp = dst;
   byte_t* dstend = dst + dstsize;
 
   uint64_t decompressed_size;
-  CHECK(varint_decode(&srcp, srcend - srcp, &decompressed_size), "couldn't decode decompressed size");
+  unsigned flags;
+  CHECK(decode_header(&srcp, srcend - srcp, &decompressed_size, &flags), "couldn't decode decompressed size");
+  CHECK(!(flags & ~(HEADER_FLAG_CHECKSUM | HEADER_FLAG_REFERENCE)), "unknown header flags");
+  CHECK(ref || !(flags & HEADER_FLAG_REFERENCE), "message was compressed against a reference, but none was provided");
+
+  checksum_t checksumstate;
+  byte_t* dstchecked = dst;
+  uint64_t expectedchecksum = 0;
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    CHECK(srcend - srcp >= CHECKSUM_SIZE, "message too small to hold checksum");
+    srcend -= CHECKSUM_SIZE;
+    // read it now, in case we're decompressing in place
+    expectedchecksum = read_checksum(srcend);
+    checksum_init(&checksumstate);
+  }
 
   while (srcp < srcend) {
     size_t litlen;
     CHECK(varint_decode(&srcp, srcend - srcp, &litlen), "couldn't decode litlen");
     CHECK(srcp + litlen <= srcend, "literal extends past end of source buffer");
     CHECK(dstp + litlen <= dstend, "literal too big for destination buffer");
-    memcpy(dstp, srcp, litlen);
+    memmove(dstp, srcp, litlen);
     srcp += litlen;
     dstp += litlen;
     if (srcp >= srcend) {
@@ -176,15 +642,67 @@ size_t decompress(
     size_t matchlen;
     CHECK(varint_decode(&srcp, srcend - srcp, &matchoff), "couldn't decode match offset");
     CHECK(varint_decode(&srcp, srcend - srcp, &matchlen), "couldn't decode match length");
-    const byte_t *match = dstp - matchoff - matchlen;
-    CHECK(match >= dst, "illegal match: match start is before beginning of input");
     CHECK(dstp + matchlen <= dstend, "match too big for destination buffer");
-    memcpy(dstp, match, matchlen);
+    CHECK(!inplace || matchlen <= (size_t) (srcp - dstp), "match would overwrite input not yet read");
+    size_t dstpos = dstp - dst;
+    CHECK(matchoff <= refsize + dstpos && matchlen <= refsize + dstpos - matchoff,
+        "illegal match: match start is before beginning of input");
+    if (unlikely(matchoff + matchlen > dstpos)) {
+      // the match starts in the reference, and may run on into dst
+      const byte_t* match = ref + refsize + dstpos - matchoff - matchlen;
+      size_t reflen = MIN(matchlen, (size_t) (ref + refsize - match));
+      memcpy(dstp, match, reflen);
+      memcpy(dstp + reflen, dst, matchlen - reflen);
+    } else {
+      memcpy(dstp, dstp - matchoff - matchlen, matchlen);
+    }
     dstp += matchlen;
+    if ((flags & HEADER_FLAG_CHECKSUM) && dstp - dstchecked >= CHECKSUM_SPAN) {
+      checksum_update(&checksumstate, dstchecked, dstp - dstchecked);
+      dstchecked = dstp;
+    }
   }
 
   CHECK(srcp == srcend, "ran past end of source buffer");
   CHECK(dstp - dst == (ptrdiff_t) decompressed_size, "decompressed to size other than promised");
 
-  return dstp - dst;
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    checksum_update(&checksumstate, dstchecked, dstp - dstchecked);
+    CHECK(
+        (checksum_digest(&checksumstate) & 0xFFFFFFFFu) == expectedchecksum,
+        "checksum mismatch: decompressed content is corrupt");
+  }
+
+  *decodedsize = dstp - dst;
+  return 1;
+}
+
+size_t decompress(
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize) {
+  size_t size;
+  return decompress_impl(dst, dstsize, src, srcsize, NULL, 0, 0, &size) ? size : 0;
+}
+
+size_t decompress_inplace(byte_t* buf, size_t bufsize, size_t srcsize) {
+  CHECK(srcsize <= bufsize, "message bigger than its buffer");
+  size_t size;
+  return decompress_impl(buf, bufsize, buf + bufsize - srcsize, srcsize, NULL, 0, 1, &size) ? size : 0;
+}
+
+size_t decompress_with_reference(
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize,
+    const byte_t* ref, size_t refsize) {
+  size_t size;
+  return decompress_impl(dst, dstsize, src, srcsize, ref, refsize, 0, &size) ? size : 0;
+}
+
+int verify_empty_message(
+    const byte_t* src, size_t srcsize,
+    const byte_t* ref, size_t refsize) {
+  // nothing gets written, but dst still has to point somewhere
+  byte_t dst;
+  size_t size;
+  return decompress_impl(&dst, 0, src, srcsize, ref, refsize, 0, &size) && !size;
 }
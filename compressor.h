@@ -11,7 +11,20 @@
  * The wire format of the compressed data is as follows.
  *
  * Every message begins with a header. Currently this is just a varint
- * encoding the decompressed size of the message.
+ * encoding the decompressed size of the message, shifted left by
+ * HEADER_FLAG_BITS, with the low bits holding flags that describe the
+ * message:
+ *
+ *   HEADER_FLAG_CHECKSUM: the message ends in a CHECKSUM_SIZE-byte trailer
+ *     holding the low 32 bits of the XXH3 hash (see checksum.h) of the
+ *     decompressed contents, stored little-endian.
+ *
+ *   HEADER_FLAG_REFERENCE: the message was compressed against a reference
+ *     (see cctx_load_reference()), and must be decompressed with the same
+ *     one.
+ *
+ * The flag bits are a breaking change: messages from before they were added
+ * hold the unshifted size, and don't decode correctly.
  *
  * After the header, the compressed stream is composed of a series of
  * alternating literal blocks and match instructions. The stream must start
@@ -28,6 +41,8 @@
  * Note that the match offset is the distance, in bytes, between the current
  * position in the stream and the /end/ of the matched block. The beginning of
  * the match block is matchoff + matchlen bytes back from the current position.
+ * When there is a reference, it is treated as immediately preceding the
+ * decompressed stream, so matches may reach back into it.
  *
  * See varint.h for a description of their encoding
  */
@@ -36,34 +51,146 @@
 #define TABLE_SIZE_LOG 14
 #endif
 
+#define MAX_TABLE_SIZE_LOG 30
+
+// inputs up to this size with no reference are compressed with a small
+// table of 16-bit positions sized to the input, between these bounds, rather
+// than the main table
+#define SMALL_INPUT_MAX 4096
+#define SMALL_TABLE_SIZE_LOG_MIN 10
+#define SMALL_TABLE_SIZE_LOG 12
+
 #define MIN_MATCH 4
 
+#define HEADER_FLAG_BITS 2
+#define HEADER_FLAG_CHECKSUM 1
+#define HEADER_FLAG_REFERENCE 2
+
+#define CHECKSUM_SIZE 4
+
 typedef unsigned char byte_t;
 
 typedef unsigned int hash_t;
 
 typedef struct {
-  size_t* table;
+  size_t* table; // NULL until first used
+  unsigned tablelog;
   size_t tablesize; // size in entries, not bytes
+  int allocflags; // how the table was allocated, see alloc.h
   size_t tableoffset;
+  // whether to append a checksum of the content to compressed messages
+  int checksum;
+  // how many positions the match finder steps forward after a position
+  // where it didn't find a match. 1 searches every position; larger values
+  // trade compression ratio for speed.
+  size_t acceleration;
+  // reference loaded for the next compression, if any
+  const byte_t* ref;
+  size_t refsize;
+  // the small-input table: positions plus one, or 0 where empty. The
+  // entries the last small compression filled in are listed in
+  // smalltouched, so that clearing them only costs as much as that did.
+  uint16_t smalltable[1 << SMALL_TABLE_SIZE_LOG];
+  uint16_t smalltouched[1 << SMALL_TABLE_SIZE_LOG];
+  size_t numsmalltouched;
 } cctx_t;
 
 /**
- * Allocates a compression context.
+ * A sequence: a run of literals followed by a match, as described above. In
+ * a series of sequences, the final one's match may be empty.
+ */
+typedef struct {
+  uint64_t literal_length;
+  const byte_t* literals;
+  uint64_t match_offset;
+  uint64_t match_length;
+} litandmatch_t;
+
+/**
+ * A buffer of sequences, filled by find_sequences() or
+ * decode_literals_and_matches(). The caller provides lams and its capacity
+ * (in entries). If growable is set, lams must come from malloc() (or be NULL
+ * with a capacity of 0), and is realloc()ed as needed; otherwise filling it
+ * past capacity fails. Either way the caller frees lams.
+ */
+typedef struct {
+  litandmatch_t* lams;
+  size_t numlams;
+  size_t capacity;
+  int growable;
+} lambuf_t;
+
+/**
+ * Appends a sequence to the buffer, growing it if allowed.
+ * Returns whether successful.
+ */
+int lambuf_push(
+    lambuf_t* lams,
+    uint64_t literal_length, const byte_t* literals,
+    uint64_t match_offset, uint64_t match_length);
+
+/**
+ * Allocates a compression context. Checksums are off by default; set
+ * cctx->checksum to enable them. Acceleration defaults to 1.
+ *
+ * The table is allocated the first time an input needs it, so a context
+ * that only ever compresses inputs of up to SMALL_INPUT_MAX bytes never
+ * pays for one.
  */
 cctx_t* make_cctx(void);
 
+/**
+ * Allocates a compression context with a table of 1 << tablelog entries,
+ * rather than the default TABLE_SIZE_LOG. Larger tables remember more of the
+ * input, which mostly matters when compressing against a large reference.
+ */
+cctx_t* make_cctx_sized(unsigned tablelog);
+
+/**
+ * Allocates a compression context with a table of 1 << tablelog entries,
+ * allocated according to allocflags (see alloc.h). E.g. ALLOC_HUGE_PAGES to
+ * cut down on TLB misses from table probes when the table is large, or
+ * ALLOC_LOCAL_NODE to keep a worker thread's table on its own NUMA node.
+ */
+cctx_t* make_cctx_with_flags(unsigned tablelog, int allocflags);
+
 /**
  * Frees a compression context.
  */
 int free_cctx(cctx_t* cctx);
 
+/**
+ * Loads a reference for the next call to compress(), which will then be able
+ * to encode parts of its input as matches into the reference. This makes it
+ * cheap to compress a new version of some content against an old one. The
+ * reference must stay valid until that call returns, and the result must be
+ * decompressed with decompress_with_reference() and the same reference.
+ *
+ * Only a sparse subset of the reference's positions is indexed, so the cost
+ * of loading it is proportional to the table size rather than the reference
+ * size. Like the rest of the table, it's used up by the next compression;
+ * load it again to compress another input against it.
+ * Returns whether successful.
+ */
+int cctx_load_reference(cctx_t* cctx, const byte_t* ref, size_t refsize);
+
 /**
  * Returns an upper bound on how much space it could take to compress a
  * srcsize-sized input.
  */
 size_t compressed_size_bound(size_t srcsize);
 
+/**
+ * Returns how much bigger than its decompressed size a buffer has to be for
+ * a message to be decompressed in place in it (see decompress_inplace()).
+ * Messages from compress() and compress_sequences() never need more: both
+ * only emit matches that decompress to at least as many bytes as the
+ * sequence they end takes to encode, so the output can never catch up with
+ * the input it hasn't read yet by more than the size header, the last
+ * literal length, and the checksum.
+ */
+size_t decompress_inplace_margin(size_t decompressed_size);
+
 /**
  * Reads decompressed size from the compressed blob's header
  */
@@ -78,6 +205,62 @@ size_t compress(
     byte_t* dst, size_t dstsize,
     const byte_t* src, size_t srcsize);
 
+/**
+ * Runs the match finder over src, and rather than encoding its results,
+ * stores them in lams (replacing whatever it held). The sequences' literals
+ * point into src. Like compress(), uses up any reference loaded into cctx.
+ * Returns whether successful.
+ */
+int find_sequences(
+    cctx_t* cctx,
+    lambuf_t* lams,
+    const byte_t* src, size_t srcsize);
+
+/**
+ * Builds a compressed message for src out of the given sequences, e.g. ones
+ * from find_sequences(), or from a caller's own match finder. The sequences
+ * must exactly describe src: their lengths must add up to srcsize, and each
+ * match must repeat the bytes its offset points to. The lengths and offsets
+ * are validated, but the match contents aren't. Literal bytes are copied
+ * from src; the literals pointers aren't used.
+ *
+ * Checksums follow cctx->checksum, and if a reference is loaded into cctx
+ * (and used up), matches may reach back into it.
+ * Returns 0 on failure.
+ */
+size_t compress_sequences(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize,
+    const litandmatch_t* lams, size_t numlams);
+
+/**
+ * One entry in a batch compression call. The caller fills in the buffers;
+ * compress_batch() fills in result with the compressed size of this item, or
+ * 0 if this item failed to compress.
+ */
+typedef struct {
+  byte_t* dst;
+  size_t dstsize;
+  const byte_t* src;
+  size_t srcsize;
+  size_t result;
+} batchitem_t;
+
+/**
+ * Compresses each item's src into its dst, as independent messages that can
+ * each be passed to decompress() on its own, and sets each item's result to
+ * what compress() would have returned for it. This is just a loop calling
+ * compress() on the items in turn with the one context, plus a prefetch of
+ * the next item's input while it works on the current one, which helps when
+ * many small records are scattered in memory. There's no per-item setup
+ * saved over calling compress() directly.
+ * Returns the number of items that compressed successfully.
+ */
+size_t compress_batch(
+    cctx_t* cctx,
+    batchitem_t* items, size_t numitems);
+
 /**
  * Decompresses src into dst.
  * Returns 0 on failure.
@@ -86,4 +269,36 @@ size_t decompress(
     byte_t* dst, size_t dstsize,
     const byte_t* src, size_t srcsize);
 
+/**
+ * Decompresses a message held in the last srcsize bytes of buf into the
+ * start of buf, so that only one buffer is needed. For a message from this
+ * library, a bufsize of decompressed_size() plus
+ * decompress_inplace_margin() is always enough. A message that would
+ * overwrite input it hasn't read yet is rejected, but buf's contents are
+ * lost either way. Messages compressed against a reference aren't
+ * supported.
+ * Returns 0 on failure.
+ */
+size_t decompress_inplace(byte_t* buf, size_t bufsize, size_t srcsize);
+
+/**
+ * Decompresses src, which was compressed against ref, into dst.
+ * Returns 0 on failure.
+ */
+size_t decompress_with_reference(
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize,
+    const byte_t* ref, size_t refsize);
+
+/**
+ * Checks a message that decompressed_size() says is empty. The decompress
+ * functions return 0 both for those and on failure, so this is how to tell
+ * whether one is actually intact. ref may be NULL if the message wasn't
+ * compressed against one.
+ * Returns whether it decompresses, to nothing.
+ */
+int verify_empty_message(
+    const byte_t* src, size_t srcsize,
+    const byte_t* ref, size_t refsize);
+
 #endif
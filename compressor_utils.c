@@ -4,6 +4,21 @@
 
 #include "varint.h"
 
+int encode_header(byte_t** buf, size_t size, uint64_t decompressed_size, unsigned flags) {
+  CHECK(decompressed_size < (1ull << (64 - HEADER_FLAG_BITS)), "decompressed size too large to encode");
+  return varint_encode(buf, size, (decompressed_size << HEADER_FLAG_BITS) | flags);
+}
+
+int decode_header(const byte_t** buf, size_t size, uint64_t* decompressed_size, unsigned* flags) {
+  uint64_t header;
+  if (!varint_decode(buf, size, &header)) {
+    return 0;
+  }
+  *decompressed_size = header >> HEADER_FLAG_BITS;
+  *flags = header & ((1 << HEADER_FLAG_BITS) - 1);
+  return 1;
+}
+
 size_t encode_literals_and_matches(
     byte_t* dst, size_t dstsize,
     const litandmatch_t* lams, size_t numlams) {
@@ -14,7 +29,7 @@ size_t encode_literals_and_matches(
   for (const litandmatch_t* lam = lams; lam < lamsend; lam++) {
     decompressed_size += lam->literal_length + lam->match_length;
   }
-  CHECK(varint_encode(&dstp, dstend - dstp, decompressed_size), "couldn't encode decompressed size");
+  CHECK(encode_header(&dstp, dstend - dstp, decompressed_size, 0), "couldn't encode decompressed size");
   for (const litandmatch_t* lam = lams; lam < lamsend; lam++) {
     uint64_t litlen = lam->literal_length;
     CHECK(varint_encode(&dstp, dstend - dstp, litlen), "couldn't encode litlen");
@@ -28,29 +43,34 @@ size_t encode_literals_and_matches(
   return dstp - dst;
 }
 
-size_t decode_literals_and_matches(
+int decode_literals_and_matches(
     const byte_t* src, size_t srcsize,
-    litandmatch_t* lams, size_t numlams) {
+    lambuf_t* lams) {
   const byte_t* srcend = src + srcsize;
   const byte_t* srcp = src;
-  litandmatch_t* lamsend = lams + numlams;
-  litandmatch_t* lam = lams;
   uint64_t decompressed_size;
-  CHECK(varint_decode(&srcp, srcend - srcp, &decompressed_size), "couldn't decode decompressed size");
-  for (; srcp < srcend && lam < lamsend; lam++) {
-    CHECK(varint_decode(&srcp, srcend - srcp, &(lam->literal_length)), "couldn't decode litlen");
-    lam->literals = srcp;
-    srcp += lam->literal_length;
-    if (srcp >= srcend) {
-      // allow eliding the final match
-      lam->match_offset = 0;
-      lam->match_length = 0;
-      break;
+  unsigned flags;
+  CHECK(decode_header(&srcp, srcend - srcp, &decompressed_size, &flags), "couldn't decode decompressed size");
+  if (flags & HEADER_FLAG_CHECKSUM) {
+    CHECK(srcend - srcp >= CHECKSUM_SIZE, "message too small to hold checksum");
+    srcend -= CHECKSUM_SIZE;
+  }
+  while (srcp < srcend) {
+    uint64_t litlen;
+    uint64_t matchoff = 0;
+    uint64_t matchlen = 0;
+    CHECK(varint_decode(&srcp, srcend - srcp, &litlen), "couldn't decode litlen");
+    CHECK(litlen <= (uint64_t) (srcend - srcp), "literal extends past end of source buffer");
+    const byte_t* literals = srcp;
+    srcp += litlen;
+    // allow eliding the final match
+    if (srcp < srcend) {
+      CHECK(varint_decode(&srcp, srcend - srcp, &matchoff), "couldn't decode match offset");
+      CHECK(varint_decode(&srcp, srcend - srcp, &matchlen), "couldn't decode match length");
     }
-    CHECK(varint_decode(&srcp, srcend - srcp, &(lam->match_offset)), "couldn't decode match offset");
-    CHECK(varint_decode(&srcp, srcend - srcp, &(lam->match_length)), "couldn't decode match length");
+    CHECK(lambuf_push(lams, litlen, literals, matchoff, matchlen), "sequence buffer full");
   }
-  return lam - lams;
+  return 1;
 }
 
 void print_literal_and_match(FILE* f, const litandmatch_t* lam) {
@@ -173,7 +193,7 @@ size_t noop_compress(
   const byte_t* srcp = src;
   byte_t* dstend = dst + dstsize;
   byte_t* dstp = dst;
-  CHECK(varint_encode(&dstp, dstend - dstp, srcsize), "couldn't encode decompressed size");
+  CHECK(encode_header(&dstp, dstend - dstp, srcsize, 0), "couldn't encode decompressed size");
   CHECK(varint_encode(&dstp, dstend - dstp, srcsize), "couldn't encode litlen");
   CHECK(dstend - dstp >= (ptrdiff_t)srcsize, "input too large for destination buffer");
   memcpy(dstp, srcp, srcsize);
@@ -13,6 +13,20 @@
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #endif
 
+/**
+ * Marks a hot kernel to be compiled once for each of the instruction set
+ * levels listed here. The best version the running CPU supports is picked by
+ * cpuid when the binary is loaded (through an ifunc resolver), so a single
+ * portable build runs at near-native speed on both old and new hosts. Define
+ * NO_MULTIVERSION to compile just the one version for the build's -march.
+ */
+#if defined(__x86_64__) && defined(__ELF__) && !defined(NO_MULTIVERSION)
+#define MULTIVERSION __attribute__((target_clones( \
+    "default", "arch=x86-64-v2", "arch=x86-64-v3", "arch=x86-64-v4")))
+#else
+#define MULTIVERSION
+#endif
+
 #define CHECKR(EXPR, MSG, RET) \
   if (unlikely(!(EXPR))) { \
     fprintf(stderr, "Error: %s\n", MSG); \
@@ -36,22 +50,49 @@
 })
 
 /**
- *
+ * Writes a message header (see compressor.h) to the beginning of the provided
+ * buffer and advances the buffer pointer past it. Returns whether successful.
  */
-typedef struct {
-  uint64_t literal_length;
-  const byte_t* literals;
-  uint64_t match_offset;
-  uint64_t match_length;
-} litandmatch_t;
+int encode_header(byte_t** buf, size_t size, uint64_t decompressed_size, unsigned flags);
+
+/**
+ * Reads a message header from the beginning of the provided buffer and
+ * advances the buffer pointer past it. Returns whether successful.
+ */
+int decode_header(const byte_t** buf, size_t size, uint64_t* decompressed_size, unsigned* flags);
+
+/**
+ * Writes a checksum trailer: the low CHECKSUM_SIZE bytes of hash,
+ * little-endian.
+ */
+static inline void write_checksum(byte_t* dst, uint64_t hash) {
+  for (size_t i = 0; i < CHECKSUM_SIZE; i++) {
+    dst[i] = hash >> (i * 8);
+  }
+}
+
+/**
+ * Reads a checksum trailer written by write_checksum().
+ */
+static inline uint64_t read_checksum(const byte_t* src) {
+  uint64_t hash = 0;
+  for (size_t i = 0; i < CHECKSUM_SIZE; i++) {
+    hash |= ((uint64_t) src[i]) << (i * 8);
+  }
+  return hash;
+}
 
 size_t encode_literals_and_matches(
     byte_t* dst, size_t dstsize,
     const litandmatch_t* lams, size_t numlams);
 
-size_t decode_literals_and_matches(
+/**
+ * Parses a compressed message into its sequences, appending them to lams.
+ * Returns whether successful.
+ */
+int decode_literals_and_matches(
     const byte_t* src, size_t srcsize,
-    litandmatch_t* lams, size_t numlams);
+    lambuf_t* lams);
 
 void print_literal_and_match(FILE* f, const litandmatch_t* lam);
 
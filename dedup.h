@@ -0,0 +1,90 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "compressor.h"
+
+/**
+ * A deduplicating pre-stage for inputs, like backups or tarballs of many
+ * similar files, where the same large regions recur at arbitrary offsets,
+ * too far apart for the compressor's table to remember.
+ *
+ * The input is cut into chunks at content-defined boundaries (FastCDC, using
+ * a gear rolling hash), so that a region shifted by an insertion upstream is
+ * still cut into the same chunks. Each chunk is fingerprinted, and chunks
+ * that have already been seen are replaced by a reference to their first
+ * occurrence. Only the unique chunks go through compress().
+ *
+ * The wire format is:
+ *
+ *   header,
+ *   varint numchunks,
+ *   chunk[numchunks] recipe,
+ *   byte[] message,
+ *   byte[CHECKSUM_SIZE] checksum (if HEADER_FLAG_CHECKSUM is set)
+ *
+ * Where each chunk in the recipe is either a new chunk:
+ *
+ *   varint chunklen << 1
+ *
+ * whose contents are the next chunklen bytes of the unique data, or a
+ * duplicate:
+ *
+ *   varint chunklen << 1 | 1,
+ *   varint chunkoff
+ *
+ * whose contents are the chunklen bytes at chunkoff in the decompressed
+ * output. The message is the compressed (see compressor.h) concatenation of
+ * the new chunks, in order, and runs to the checksum, or else the end of the
+ * blob.
+ *
+ * The header is the same as a message's (see compressor.h), but only
+ * HEADER_FLAG_CHECKSUM may be set. When it is (when cctx->checksum is set),
+ * the trailer is a checksum of the whole decompressed output, so it covers
+ * the recipe as well as the message, which then doesn't carry its own.
+ */
+
+#define DEDUP_MIN_CHUNK (2 * 1024)
+#define DEDUP_AVG_CHUNK (8 * 1024)
+#define DEDUP_MAX_CHUNK (64 * 1024)
+
+/**
+ * Returns the length of the first chunk of src.
+ */
+size_t dedup_chunk_length(const byte_t* src, size_t srcsize);
+
+/**
+ * Returns an upper bound on how much space it could take to dedup and
+ * compress a srcsize-sized input.
+ */
+size_t dedup_compressed_size_bound(size_t srcsize);
+
+/**
+ * Reads decompressed size from a dedup blob's header.
+ */
+size_t dedup_decompressed_size(const byte_t* src, size_t srcsize);
+
+/**
+ * Deduplicates and compresses src into dst.
+ * Returns 0 on failure.
+ */
+size_t dedup_compress(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize);
+
+/**
+ * Decompresses a dedup blob src into dst.
+ * Returns 0 on failure.
+ */
+size_t dedup_decompress(
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize);
+
+/**
+ * Checks a dedup blob that dedup_decompressed_size() says is empty, since
+ * dedup_decompress() returns 0 both for those and on failure.
+ * Returns whether it decompresses, to nothing.
+ */
+int dedup_verify_empty(const byte_t* src, size_t srcsize);
+
+#endif
@@ -1,34 +1,330 @@
+#include "alloc.h"
+#include "archive.h"
 #include "compressor.h"
 #include "compressor_utils.h"
+#include "dedup.h"
+#include "stream.h"
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// cap on the table size picked for -r, 1 << 24 entries is 128 MB
+#define REF_MAX_TABLE_SIZE_LOG 24
 
 void usage(void) {
   fprintf(stderr,
       "Incorrect usage!\n"
       "Compresses / decompresses stdin -> stdout.\n"
       "No args to compress, -d to decompress.\n"
+      "  -c  append a checksum of the content when compressing\n"
+      "  -D  print the literals and matches of a compressed input\n"
+      "  -a  adaptive block stream: compress in blocks, and trade ratio for\n"
+      "      speed depending on how fast stdout drains (use -d -a to\n"
+      "      decompress)\n"
+      "  -l MIN,MAX  bounds on the acceleration -a may pick (default %d,%d)\n"
+      "  -r FILE  compress against (or decompress with) a reference file, e.g.\n"
+      "           a previous version of the input\n"
+      "  -u  deduplicate repeated chunks of the input before compressing it\n"
+      "      (use -d -u to decompress)\n"
+      "  -H  back the match table and I/O buffers with huge pages\n"
+      "Archives:\n"
+      "  -A PATH...  compress files and directories into an archive on stdout\n"
+      "  -j N  number of files to compress at once with -A (default: one per\n"
+      "        CPU)\n"
+      "  -T  list the files in an archive on stdin\n"
+      "  -X NAME  extract one file from an archive on stdin to stdout\n",
+      ADAPT_MIN_ACCELERATION, ADAPT_MAX_ACCELERATION
   );
   exit(1);
 }
 
+static int write_all(const byte_t* buf, size_t size) {
+  size_t written = 0;
+  size_t bytes_written;
+  while (size - written && (bytes_written = fwrite(buf + written, 1, size - written, stdout))) {
+    written += bytes_written;
+  }
+  return written == size;
+}
+
+/**
+ * Maps a whole file into memory read-only, for use as a reference.
+ */
+static const byte_t* map_file(const char* path, size_t* size) {
+  int fd = open(path, O_RDONLY);
+  CHECKR(fd >= 0, "failed to open reference file", NULL);
+  struct stat st;
+  CHECKR(!fstat(fd, &st), "failed to stat reference file", NULL);
+  *size = st.st_size;
+  if (!*size) {
+    close(fd);
+    return (const byte_t*) "";
+  }
+  const byte_t* buf = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  CHECKR(buf != MAP_FAILED, "failed to map reference file", NULL);
+  // we only ever skim it sparsely and then read the regions that match
+  madvise((void*) buf, *size, MADV_RANDOM);
+  return buf;
+}
+
+/**
+ * Picks a table big enough that a reference gets indexed about every 8 bytes,
+ * within reason.
+ */
+static unsigned table_log_for_reference(size_t refsize) {
+  unsigned tablelog = TABLE_SIZE_LOG;
+  while (tablelog < REF_MAX_TABLE_SIZE_LOG && ((size_t) 1 << tablelog) < refsize / 8) {
+    tablelog++;
+  }
+  return tablelog;
+}
+
+/**
+ * Reads a message's decompressed size, failing if the header can't be read,
+ * unlike decompressed_size(), which returns 0 then.
+ */
+static int read_message_size(const byte_t* buf, size_t size, size_t* osize) {
+  uint64_t val;
+  unsigned flags;
+  CHECK(decode_header(&buf, size, &val, &flags), "couldn't decode decompressed size");
+  CHECK(val <= SIZE_MAX, "decompressed size too large");
+  *osize = val;
+  return 1;
+}
+
+static void print_summary(int decompressed, size_t isize, size_t osize) {
+  fprintf(
+      stderr,
+      "%s %lu bytes into %lu bytes (%.3lfx).\n",
+      decompressed ? "Decompressed" : "Compressed",
+      isize,
+      osize,
+      decompressed ? ((double) osize) / isize : ((double) isize) / osize
+  );
+}
+
+/**
+ * Compresses stdin to stdout as an adaptive block stream (see stream.h),
+ * reading and writing one block at a time. Each block's output is flushed
+ * before the next is compressed, so the time that takes reflects how fast
+ * whatever is downstream of us is consuming it. allocflags are passed to
+ * large_alloc() for the buffers and the match table, as elsewhere.
+ */
+static int compress_stream(int should_checksum, size_t minaccel, size_t maxaccel, int allocflags) {
+  byte_t* ibuf = large_alloc(STREAM_BLOCK_SIZE, allocflags);
+  CHECK1(ibuf, "failed to allocate input buffer");
+  size_t osize = stream_block_bound(STREAM_BLOCK_SIZE);
+  byte_t* obuf = large_alloc(osize, allocflags);
+  CHECK1(obuf, "failed to allocate output buffer");
+
+  cctx_t* cctx = make_cctx_with_flags(TABLE_SIZE_LOG, allocflags);
+  CHECK1(cctx, "failed to allocate compression context");
+  cctx->checksum = should_checksum;
+
+  adapt_t adapt;
+  adapt_init(&adapt, minaccel, maxaccel);
+
+  size_t itotal = 0;
+  size_t ototal = 0;
+  size_t bytes_read;
+  do {
+    size_t ipos = 0;
+    while (ipos < STREAM_BLOCK_SIZE && (bytes_read = fread(ibuf + ipos, 1, STREAM_BLOCK_SIZE - ipos, stdin))) {
+      ipos += bytes_read;
+    }
+    if (!ipos) {
+      break;
+    }
+
+    size_t opos = adapt_compress_block(&adapt, cctx, obuf, osize, ibuf, ipos);
+    CHECK1(opos, "compression failed");
+
+    uint64_t start = now_ns();
+    CHECK1(write_all(obuf, opos), "failed to write all of the output");
+    CHECK1(!fflush(stdout), "failed to flush the output");
+    adapt_drained(&adapt, now_ns() - start);
+
+    itotal += ipos;
+    ototal += opos;
+  } while (bytes_read);
+
+  free_cctx(cctx);
+  large_free(obuf, osize, allocflags);
+  large_free(ibuf, STREAM_BLOCK_SIZE, allocflags);
+
+  print_summary(0, itotal, ototal);
+  fprintf(stderr, "Finished at acceleration %lu.\n", adapt.acceleration);
+  return 0;
+}
+
+/**
+ * Decompresses a block stream held in ibuf to stdout, one block at a time.
+ */
+static int decompress_stream(const byte_t* ibuf, size_t isize) {
+  const byte_t* ipos = ibuf;
+  const byte_t* iend = ibuf + isize;
+  byte_t* obuf = NULL;
+  size_t osize = 0;
+  size_t ototal = 0;
+
+  while (ipos < iend) {
+    const byte_t* block;
+    size_t blocksize;
+    CHECK1(stream_read_block(&ipos, iend - ipos, &block, &blocksize), "failed to read block");
+
+    size_t bsize;
+    CHECK1(read_message_size(block, blocksize, &bsize), "failed to read block header");
+    if (!bsize) {
+      CHECK1(verify_empty_message(block, blocksize, NULL, 0), "decompression failed");
+      continue;
+    }
+    if (bsize > osize) {
+      osize = bsize;
+      obuf = realloc(obuf, osize);
+      CHECK1(obuf, "failed to grow output buffer");
+    }
+
+    CHECK1(decompress(obuf, osize, block, blocksize) == bsize, "decompression failed");
+    CHECK1(write_all(obuf, bsize), "failed to write all of the output");
+    ototal += bsize;
+  }
+
+  free(obuf);
+
+  print_summary(1, isize, ototal);
+  return 0;
+}
+
+/**
+ * Lists or extracts from an archive on stdin, which has to be a file so that
+ * we can seek around in it.
+ */
+static int read_archive(const char* name) {
+  archive_index_t index;
+  CHECK1(archive_read_index(stdin, &index), "failed to read archive");
+
+  int ret = 0;
+  if (name) {
+    const archive_entry_t* entry = archive_find(&index, name);
+    if (!entry) {
+      fprintf(stderr, "Error: %s not found in archive\n", name);
+      ret = 1;
+    } else if (!archive_extract(stdin, entry, stdout)) {
+      ret = 1;
+    }
+  } else {
+    for (size_t i = 0; i < index.numentries; i++) {
+      const archive_entry_t* entry = &index.entries[i];
+      printf("%12lu %12lu  %s\n", entry->decompressed_size, entry->compressed_size, entry->name);
+    }
+  }
+
+  archive_free_index(&index);
+  return ret;
+}
+
 int main(int argc, char *argv[]) {
   int should_decompress = 0;
   int should_debug = 0;
-  if (argc == 1) {
-  } else if (argc == 2 && !strcmp("-d", argv[1])) {
-    should_decompress = 1;
-  } else if (argc == 2 && !strcmp("-D", argv[1])) {
-    should_decompress = 1;
-    should_debug = 1;
-  } else {
+  int should_checksum = 0;
+  int should_stream = 0;
+  int should_dedup = 0;
+  int should_archive = 0;
+  int should_list = 0;
+  const char* extractname = NULL;
+  long numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int allocflags = 0;
+  const char* refpath = NULL;
+  size_t minaccel = ADAPT_MIN_ACCELERATION;
+  size_t maxaccel = ADAPT_MAX_ACCELERATION;
+  int opt;
+  while ((opt = getopt(argc, argv, "dDcal:r:uHATX:j:")) != -1) {
+    switch (opt) {
+      case 'd':
+        should_decompress = 1;
+        break;
+      case 'D':
+        should_decompress = 1;
+        should_debug = 1;
+        break;
+      case 'c':
+        should_checksum = 1;
+        break;
+      case 'a':
+        should_stream = 1;
+        break;
+      case 'r':
+        refpath = optarg;
+        break;
+      case 'u':
+        should_dedup = 1;
+        break;
+      case 'H':
+        allocflags |= ALLOC_HUGE_PAGES;
+        break;
+      case 'A':
+        should_archive = 1;
+        break;
+      case 'T':
+        should_list = 1;
+        break;
+      case 'X':
+        extractname = optarg;
+        break;
+      case 'j':
+        numthreads = atol(optarg);
+        if (numthreads <= 0) {
+          usage();
+        }
+        break;
+      case 'l':
+        if (sscanf(optarg, "%lu,%lu", &minaccel, &maxaccel) != 2 || !minaccel || minaccel > maxaccel) {
+          usage();
+        }
+        break;
+      default:
+        usage();
+    }
+  }
+  if (should_archive + should_list + !!extractname) {
+    if (should_archive + should_list + !!extractname > 1 || should_decompress || should_stream ||
+        should_dedup || refpath || allocflags || (should_archive ? optind == argc : optind != argc)) {
+      usage();
+    }
+    if (should_archive) {
+      return !archive_create(stdout, (const char* const*) argv + optind, argc - optind,
+          numthreads > 0 ? numthreads : 1, should_checksum);
+    }
+    if (should_checksum) {
+      usage();
+    }
+    return read_archive(extractname);
+  }
+
+  if (optind != argc || (should_checksum && should_decompress) || (refpath && should_stream) ||
+      (should_dedup && (refpath || should_stream || should_debug))) {
     usage();
   }
 
+  const byte_t* ref = NULL;
+  size_t refsize = 0;
+  if (refpath) {
+    ref = map_file(refpath, &refsize);
+    CHECK1(ref, "failed to load reference");
+  }
+
+  if (should_stream && !should_decompress) {
+    return compress_stream(should_checksum, minaccel, maxaccel, allocflags);
+  }
+
   char *ibuf;
   size_t isize = 16 * 1024;
-  ibuf = malloc(isize);
+  ibuf = large_alloc(isize, allocflags);
   CHECK1(ibuf, "failed to allocate input buffer");
 
   size_t ipos = 0;
@@ -36,9 +332,9 @@ int main(int argc, char *argv[]) {
   while ((bytes_read = fread(ibuf + ipos, 1, isize - ipos, stdin))) {
     ipos += bytes_read;
     if (ipos == isize) {
-      isize *= 2;
-      ibuf = realloc(ibuf, isize);
+      ibuf = large_realloc(ibuf, isize, isize * 2, allocflags);
       CHECK1(ibuf, "failed to grow input buffer");
+      isize *= 2;
     }
   }
 
@@ -47,29 +343,87 @@ int main(int argc, char *argv[]) {
   size_t opos;
 
   if (should_debug) {
-    litandmatch_t* lams;
-    size_t lamssize = 1024; // a bunch
-    lams = malloc(lamssize * sizeof(litandmatch_t));
-    CHECK1(lams, "failed to allocate buffer for LAMs");
-    size_t numlams = decode_literals_and_matches(ibuf, ipos, lams, lamssize);
-    for (size_t i = 0; i < numlams; i++) {
-      print_literal_and_match(stderr, lams + i);
+    lambuf_t lams = {NULL, 0, 0, 1};
+    CHECK1(decode_literals_and_matches(ibuf, ipos, &lams), "failed to decode LAMs");
+    for (size_t i = 0; i < lams.numlams; i++) {
+      print_literal_and_match(stderr, lams.lams + i);
     }
+    free(lams.lams);
     return 0;
+  } else if (should_stream) {
+    int ret = decompress_stream(ibuf, ipos);
+    large_free(ibuf, isize, allocflags);
+    return ret;
+  } else if (should_dedup && should_decompress) {
+    // a size of 0 also comes back when the header can't be read, which
+    // dedup_verify_empty() catches along with anything else wrong
+    osize = dedup_decompressed_size(ibuf, ipos);
+    if (!osize) {
+      CHECK1(dedup_verify_empty(ibuf, ipos), "decompression failed");
+    }
+    obuf = large_alloc(osize, allocflags);
+    CHECK1(obuf, "failed to allocate output buffer");
+
+    opos = osize ? dedup_decompress(obuf, osize, ibuf, ipos) : 0;
+    CHECK1(opos == osize, "decompression failed");
+  } else if (should_dedup) {
+    osize = dedup_compressed_size_bound(ipos);
+    obuf = large_alloc(osize, allocflags);
+    CHECK1(obuf, "failed to allocate output buffer");
+
+    cctx_t* cctx = make_cctx_with_flags(TABLE_SIZE_LOG, allocflags);
+    CHECK1(cctx, "failed to allocate compression context");
+    cctx->checksum = should_checksum;
+
+    opos = dedup_compress(cctx, obuf, osize, ibuf, ipos);
+    CHECK1(opos, "compression failed");
+
+    free_cctx(cctx);
+  } else if (should_decompress && !ref) {
+    CHECK1(read_message_size(ibuf, ipos, &osize), "failed to read message header");
+    if (!osize) {
+      CHECK1(verify_empty_message(ibuf, ipos, NULL, 0), "decompression failed");
+    }
+
+    // decompress in place, so the input and output share one buffer: move
+    // the message to the end of a buffer just big enough for the output
+    size_t bufsize = osize + decompress_inplace_margin(osize);
+    CHECK1(ipos <= bufsize, "input is bigger than the content it describes");
+    if (bufsize > isize) {
+      ibuf = large_realloc(ibuf, isize, bufsize, allocflags);
+      CHECK1(ibuf, "failed to grow input buffer");
+      isize = bufsize;
+    }
+    memmove(ibuf + bufsize - ipos, ibuf, ipos);
+
+    opos = osize ? decompress_inplace(ibuf, bufsize, ipos) : 0;
+    CHECK1(opos == osize, "decompression failed");
+
+    // the output is the input buffer now
+    obuf = ibuf;
+    osize = isize;
+    ibuf = NULL;
   } else if (should_decompress) {
-    osize = decompressed_size(ibuf, isize);
-    obuf = malloc(osize);
+    CHECK1(read_message_size(ibuf, ipos, &osize), "failed to read message header");
+    if (!osize) {
+      CHECK1(verify_empty_message(ibuf, ipos, ref, refsize), "decompression failed");
+    }
+    obuf = large_alloc(osize, allocflags);
     CHECK1(obuf, "failed to allocate output buffer");
 
-    opos = decompress(obuf, osize, ibuf, ipos);
-    CHECK1(opos, "decompression failed");
+    opos = osize ? decompress_with_reference(obuf, osize, ibuf, ipos, ref, refsize) : 0;
+    CHECK1(opos == osize, "decompression failed");
   } else {
     osize = compressed_size_bound(isize);
-    obuf = malloc(osize);
+    obuf = large_alloc(osize, allocflags);
     CHECK1(obuf, "failed to allocate output buffer");
 
-    cctx_t* cctx = make_cctx();
+    cctx_t* cctx = make_cctx_with_flags(table_log_for_reference(refsize), allocflags);
     CHECK1(cctx, "failed to allocate compression context");
+    cctx->checksum = should_checksum;
+    if (ref) {
+      CHECK1(cctx_load_reference(cctx, ref, refsize), "failed to load reference");
+    }
 
     opos = compress(cctx, obuf, osize, ibuf, ipos);
     CHECK1(opos, "compression failed");
@@ -77,26 +431,13 @@ int main(int argc, char *argv[]) {
     free_cctx(cctx);
   }
 
-  free(ibuf);
+  large_free(ibuf, isize, allocflags);
 
-  size_t owritten = 0;
+  CHECK1(write_all(obuf, opos), "failed to write all of the output");
 
-  size_t bytes_written;
-  while (opos - owritten && (bytes_written = fwrite(obuf + owritten, 1, opos - owritten, stdout))) {
-    owritten += bytes_written;
-  }
-  CHECK1(owritten == opos, "failed to write all of the output");
+  large_free(obuf, osize, allocflags);
 
-  free(obuf);
-
-  fprintf(
-      stderr,
-      "%s %lu bytes into %lu bytes (%.3lfx).\n",
-      should_decompress ? "Decompressed" : "Compressed",
-      ipos,
-      opos,
-      should_decompress ? ((double) opos) / ipos : ((double) ipos) / opos
-  );
+  print_summary(should_decompress, ipos, opos);
 
   return 0;
 }
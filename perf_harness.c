@@ -0,0 +1,310 @@
+#include "compressor.h"
+#include "compressor_utils.h"
+#include "perf_results.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Measures compress() and decompress() with hardware performance counters,
+ * so a change in speed can be pinned on e.g. extra instructions vs. more
+ * cache misses. Results go to stdout as JSON, one result per line, and can
+ * be checked against a previous run's output with -b.
+ */
+
+#define DEFAULT_REPS 5
+#define DEFAULT_THRESHOLD 0.05
+#define MAX_RESULTS 1024
+
+#define CACHE_READ_MISS(CACHE) \
+  ((CACHE) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+} counter_def_t;
+
+static const counter_def_t COUNTERS[NUM_COUNTERS] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"l1d_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+  {"llc_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+  {"dtlb_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+static int counter_fds[NUM_COUNTERS];
+
+static void usage(void) {
+  fprintf(stderr,
+      "Incorrect usage!\n"
+      "perf_harness [options] CORPUS...\n"
+      "Measures compression and decompression of each corpus with hardware\n"
+      "performance counters, and prints the results as JSON.\n"
+      "  -l A,B,...  accelerations to measure at (default 1)\n"
+      "  -n REPS  times to repeat each measurement (default %d)\n"
+      "  -b FILE  compare against the JSON output of a previous run, and exit\n"
+      "           nonzero if anything got worse by more than the threshold\n"
+      "  -t FRAC  threshold for -b, as a fraction (default %.2f)\n",
+      DEFAULT_REPS, DEFAULT_THRESHOLD
+  );
+  exit(1);
+}
+
+/**
+ * Opens whichever counters this machine and our permissions allow. They
+ * aren't grouped, so the kernel is free to multiplex them onto however
+ * many hardware counters there are; readings are scaled up accordingly.
+ * Returns how many opened.
+ */
+static size_t open_counters(void) {
+  size_t opened = 0;
+  int errs[NUM_COUNTERS];
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = COUNTERS[i].type;
+    attr.config = COUNTERS[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    errs[i] = errno;
+    opened += counter_fds[i] >= 0;
+  }
+  // if none work, one warning about that (in main) is enough
+  for (size_t i = 0; opened && i < NUM_COUNTERS; i++) {
+    if (counter_fds[i] < 0) {
+      fprintf(stderr, "Warning: counter %s unavailable (%s)\n", COUNTERS[i].name, strerror(errs[i]));
+    }
+  }
+  return opened;
+}
+
+static void start_counters(void) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+static void stop_counters(double* counts) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    counts[i] = -1;
+    if (counter_fds[i] < 0) {
+      continue;
+    }
+    ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t vals[3];
+    if (read(counter_fds[i], vals, sizeof(vals)) == sizeof(vals) && vals[2]) {
+      counts[i] = (double) vals[0] * vals[1] / vals[2];
+    }
+  }
+}
+
+static byte_t* read_corpus(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  CHECKR(f, "failed to open corpus", NULL);
+  size_t cap = 1 << 16;
+  byte_t* buf = malloc(cap);
+  *size = 0;
+  size_t bytes_read;
+  while (buf && (bytes_read = fread(buf + *size, 1, cap - *size, f))) {
+    *size += bytes_read;
+    if (*size == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  fclose(f);
+  CHECKR(buf, "failed to read corpus", NULL);
+  return buf;
+}
+
+/**
+ * Copies a string into a JSON string body, escaping what needs it.
+ */
+static void json_escape(char* dst, size_t dstsize, const char* src) {
+  size_t pos = 0;
+  for (; *src && pos + 7 < dstsize; src++) {
+    unsigned char c = *src;
+    if (c == '"' || c == '\\') {
+      dst[pos++] = '\\';
+      dst[pos++] = c;
+    } else if (c < 0x20) {
+      pos += sprintf(dst + pos, "\\u%04x", c);
+    } else {
+      dst[pos++] = c;
+    }
+  }
+  dst[pos] = '\0';
+}
+
+/**
+ * Runs one operation reps times (after one untimed run to warm up), and
+ * fills in its metrics, per byte of uncompressed data.
+ */
+#define MEASURE(RESULT, REPS, BYTES, OUTSIZE, CALL) do { \
+  CHECK1(((OUTSIZE) = (CALL)), "operation failed"); \
+  uint64_t _start = now_ns(); \
+  start_counters(); \
+  for (size_t _rep = 0; _rep < (REPS); _rep++) { \
+    (OUTSIZE) = (CALL); \
+  } \
+  stop_counters((RESULT)->metrics); \
+  double _total = (double) (REPS) * MAX((BYTES), (size_t) 1); \
+  (RESULT)->metrics[NUM_COUNTERS] = (now_ns() - _start) / _total; \
+  for (size_t _i = 0; _i < NUM_COUNTERS; _i++) { \
+    if ((RESULT)->metrics[_i] >= 0) { \
+      (RESULT)->metrics[_i] /= _total; \
+    } \
+  } \
+} while (0)
+
+static int measure_corpus(
+    const char* path, const size_t* accels, size_t numaccels, size_t reps,
+    result_t* results, size_t* numresults) {
+  size_t srcsize;
+  byte_t* src = read_corpus(path, &srcsize);
+  CHECK1(src, "failed to load corpus");
+  size_t cbufsize = compressed_size_bound(srcsize);
+  byte_t* cbuf = malloc(cbufsize);
+  byte_t* dbuf = malloc(MAX(srcsize, (size_t) 1));
+  cctx_t* cctx = make_cctx();
+  CHECK1(cbuf && dbuf && cctx, "failed to allocate buffers");
+
+  char name[MAX_NAME_SIZE];
+  json_escape(name, sizeof(name), path);
+  for (size_t a = 0; a < numaccels; a++) {
+    CHECK1(*numresults + 2 <= MAX_RESULTS, "too many results");
+    result_t* c = &results[(*numresults)++];
+    result_t* d = &results[(*numresults)++];
+    strcpy(c->corpus, name);
+    strcpy(d->corpus, name);
+    strcpy(c->op, "compress");
+    strcpy(d->op, "decompress");
+    c->acceleration = d->acceleration = accels[a];
+
+    cctx->acceleration = accels[a];
+    size_t csize;
+    MEASURE(c, reps, srcsize, csize, compress(cctx, cbuf, cbufsize, src, srcsize));
+    c->metrics[NUM_COUNTERS + 1] = csize;
+
+    size_t dsize;
+    if (srcsize) {
+      MEASURE(d, reps, srcsize, dsize, decompress(dbuf, srcsize, cbuf, csize));
+      CHECK1(dsize == srcsize && !memcmp(src, dbuf, srcsize), "roundtrip mismatch");
+    } else {
+      for (size_t i = 0; i < NUM_COUNTERS + 1; i++) {
+        d->metrics[i] = -1;
+      }
+      dsize = 0;
+    }
+    d->metrics[NUM_COUNTERS + 1] = dsize;
+  }
+
+  free_cctx(cctx);
+  free(dbuf);
+  free(cbuf);
+  free(src);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t accels[64] = {1};
+  size_t numaccels = 1;
+  size_t reps = DEFAULT_REPS;
+  const char* baselinepath = NULL;
+  double threshold = DEFAULT_THRESHOLD;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:n:b:t:")) != -1) {
+    switch (opt) {
+      case 'l': {
+        numaccels = 0;
+        char* pos = optarg;
+        while (*pos && numaccels < sizeof(accels) / sizeof(accels[0])) {
+          char* end;
+          accels[numaccels] = strtoul(pos, &end, 10);
+          if (end == pos || !accels[numaccels] || (*end && *end != ',')) {
+            usage();
+          }
+          numaccels++;
+          pos = *end ? end + 1 : end;
+        }
+        if (!numaccels) {
+          usage();
+        }
+        break;
+      }
+      case 'n':
+        reps = strtoul(optarg, NULL, 10);
+        if (!reps) {
+          usage();
+        }
+        break;
+      case 'b':
+        baselinepath = optarg;
+        break;
+      case 't':
+        if (sscanf(optarg, "%lf", &threshold) != 1 || threshold < 0) {
+          usage();
+        }
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind == argc) {
+    usage();
+  }
+
+  if (!open_counters()) {
+    fprintf(stderr, "Warning: no performance counters available (check "
+        "/proc/sys/kernel/perf_event_paranoid), measuring time only\n");
+  }
+
+  result_t* results = malloc(MAX_RESULTS * sizeof(result_t));
+  CHECK1(results, "failed to allocate results");
+  size_t numresults = 0;
+  for (int i = optind; i < argc; i++) {
+    if (measure_corpus(argv[i], accels, numaccels, reps, results, &numresults)) {
+      return 1;
+    }
+  }
+
+  printf("{\"reps\": %lu, \"results\": [\n", reps);
+  for (size_t i = 0; i < numresults; i++) {
+    print_result(stdout, &results[i], i + 1 == numresults);
+  }
+  printf("]}\n");
+
+  int ret = 0;
+  if (baselinepath) {
+    result_t* baseline = malloc(MAX_RESULTS * sizeof(result_t));
+    CHECK1(baseline, "failed to allocate baseline");
+    FILE* f = fopen(baselinepath, "r");
+    CHECK1(f, "failed to open baseline");
+    size_t numbaseline;
+    CHECK1(read_baseline(f, baseline, MAX_RESULTS, &numbaseline), "failed to read baseline");
+    fclose(f);
+    size_t regressions = compare_results(results, numresults, baseline, numbaseline, threshold);
+    fprintf(stderr, "%lu regression%s beyond %.1f%% of baseline.\n",
+        regressions, regressions == 1 ? "" : "s", 100 * threshold);
+    ret = regressions != 0;
+    free(baseline);
+  }
+
+  free(results);
+  return ret;
+}
@@ -0,0 +1,96 @@
+#include "perf_results.h"
+
+#include <string.h>
+
+#include "compressor_utils.h"
+
+const char* const METRIC_NAMES[NUM_METRICS] = {
+  "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses", "dtlb_misses",
+  "ns", "output_size"
+};
+
+void print_result(FILE* f, const result_t* result, int last) {
+  fprintf(f, "  {\"corpus\": \"%s\", \"op\": \"%s\", \"acceleration\": %lu",
+      result->corpus, result->op, result->acceleration);
+  for (size_t i = 0; i < NUM_METRICS; i++) {
+    if (result->metrics[i] < 0) {
+      fprintf(f, ", \"%s\": null", METRIC_NAMES[i]);
+    } else {
+      fprintf(f, ", \"%s\": %.10g", METRIC_NAMES[i], result->metrics[i]);
+    }
+  }
+  fprintf(f, "}%s\n", last ? "" : ",");
+}
+
+int read_baseline(FILE* f, result_t* results, size_t maxresults, size_t* numresults) {
+  char line[4096];
+  *numresults = 0;
+  while (fgets(line, sizeof(line), f) && *numresults < maxresults) {
+    const char* corpus = strstr(line, "{\"corpus\": \"");
+    if (!corpus) {
+      continue;
+    }
+    result_t* result = &results[*numresults];
+    corpus += strlen("{\"corpus\": \"");
+    const char* end = corpus;
+    while (*end && *end != '"') {
+      end += (*end == '\\' && end[1]) ? 2 : 1;
+    }
+    if (!*end || (size_t) (end - corpus) >= MAX_NAME_SIZE) {
+      continue;
+    }
+    memcpy(result->corpus, corpus, end - corpus);
+    result->corpus[end - corpus] = '\0';
+    if (sscanf(end, "\", \"op\": \"%15[a-z]\", \"acceleration\": %lu",
+        result->op, &result->acceleration) != 2) {
+      continue;
+    }
+    for (size_t i = 0; i < NUM_METRICS; i++) {
+      char key[64];
+      sprintf(key, "\"%s\": ", METRIC_NAMES[i]);
+      const char* val = strstr(end, key);
+      result->metrics[i] = -1;
+      if (val) {
+        sscanf(val + strlen(key), "%lf", &result->metrics[i]);
+      }
+    }
+    (*numresults)++;
+  }
+  CHECK(!ferror(f), "failed to read baseline");
+  return 1;
+}
+
+size_t compare_results(
+    const result_t* results, size_t numresults,
+    const result_t* baseline, size_t numbaseline,
+    double threshold) {
+  size_t regressions = 0;
+  for (size_t r = 0; r < numresults; r++) {
+    const result_t* cur = &results[r];
+    const result_t* base = NULL;
+    for (size_t b = 0; b < numbaseline && !base; b++) {
+      if (!strcmp(cur->corpus, baseline[b].corpus) && !strcmp(cur->op, baseline[b].op) &&
+          cur->acceleration == baseline[b].acceleration) {
+        base = &baseline[b];
+      }
+    }
+    if (!base) {
+      fprintf(stderr, "Note: no baseline for %s %s at acceleration %lu\n",
+          cur->corpus, cur->op, cur->acceleration);
+      continue;
+    }
+    for (size_t i = 0; i < NUM_METRICS; i++) {
+      if (cur->metrics[i] < 0 || base->metrics[i] < 0) {
+        continue;
+      }
+      if (cur->metrics[i] > base->metrics[i] * (1 + threshold)) {
+        fprintf(stderr, "Regression: %s %s at acceleration %lu: %s %.6g -> %.6g (%+.1f%%)\n",
+            cur->corpus, cur->op, cur->acceleration, METRIC_NAMES[i],
+            base->metrics[i], cur->metrics[i],
+            base->metrics[i] ? 100 * (cur->metrics[i] / base->metrics[i] - 1) : 100.0);
+        regressions++;
+      }
+    }
+  }
+  return regressions;
+}
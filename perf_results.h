@@ -0,0 +1,60 @@
+#ifndef PERF_RESULTS_H
+#define PERF_RESULTS_H
+
+#include <stdio.h>
+
+#include "compressor.h"
+
+/**
+ * The results perf_harness measures, and how they're written out as JSON,
+ * read back in from a previous run's output, and compared against it.
+ */
+
+#define MAX_NAME_SIZE 512
+
+// the hardware counters perf_harness reads (see COUNTERS there)
+#define NUM_COUNTERS 6
+// the counters, then wall-clock time and output size
+#define NUM_METRICS (NUM_COUNTERS + 2)
+
+extern const char* const METRIC_NAMES[NUM_METRICS];
+
+/**
+ * One measurement of one operation at one acceleration on one corpus.
+ * Counters and time are per byte of uncompressed data, and negative where
+ * not available. output_size is in bytes.
+ */
+typedef struct {
+  char corpus[MAX_NAME_SIZE];
+  char op[16];
+  size_t acceleration;
+  double metrics[NUM_METRICS];
+} result_t;
+
+/**
+ * Writes one result as a line of JSON, with a trailing comma unless it's the
+ * last. corpus is written as-is, so it must already be escaped.
+ */
+void print_result(FILE* f, const result_t* result, int last);
+
+/**
+ * Pulls the results back out of a previous run's output, up to maxresults
+ * of them. This only has to understand what print_result() writes, not JSON
+ * in general: lines it can't make sense of are skipped, and metrics that are
+ * missing or null come back negative.
+ * Returns 0 if the output couldn't be read at all.
+ */
+int read_baseline(FILE* f, result_t* results, size_t maxresults, size_t* numresults);
+
+/**
+ * Reports every metric that's worse than the baseline's by more than the
+ * threshold (a fraction of the baseline's value) on stderr. Results with no
+ * counterpart in the baseline, and metrics either side lacks, are skipped.
+ * Returns how many were worse.
+ */
+size_t compare_results(
+    const result_t* results, size_t numresults,
+    const result_t* baseline, size_t numbaseline,
+    double threshold);
+
+#endif
@@ -0,0 +1,100 @@
+#include "stream.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "compressor_utils.h"
+#include "varint.h"
+
+size_t stream_block_bound(size_t srcsize) {
+  return VARINT_MAX_SIZE + compressed_size_bound(srcsize);
+}
+
+size_t stream_compress_block(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize) {
+  byte_t* dstend = dst + dstsize;
+  byte_t* dstp = dst;
+
+  // the size prefix isn't known until the block is compressed, so compress
+  // past the largest the prefix could be and then slide the message down
+  CHECK(dstsize > VARINT_MAX_SIZE, "destination buffer too small for block");
+  byte_t* msg = dst + VARINT_MAX_SIZE;
+  size_t msgsize = compress(cctx, msg, dstend - msg, src, srcsize);
+  CHECK(msgsize, "couldn't compress block");
+
+  CHECK(varint_encode(&dstp, dstend - dstp, msgsize), "couldn't encode block size");
+  memmove(dstp, msg, msgsize);
+  dstp += msgsize;
+  return dstp - dst;
+}
+
+int stream_read_block(
+    const byte_t** buf, size_t size,
+    const byte_t** block, size_t* blocksize) {
+  const byte_t* bufp = *buf;
+  const byte_t* bufend = *buf + size;
+  uint64_t msgsize;
+  CHECK(varint_decode(&bufp, bufend - bufp, &msgsize), "couldn't decode block size");
+  CHECK(msgsize <= (uint64_t) (bufend - bufp), "block extends past end of stream");
+  *block = bufp;
+  *blocksize = msgsize;
+  *buf = bufp + msgsize;
+  return 1;
+}
+
+void adapt_init(adapt_t* adapt, size_t minacceleration, size_t maxacceleration) {
+  adapt->minacceleration = MAX(minacceleration, (size_t) 1);
+  adapt->maxacceleration = MAX(maxacceleration, adapt->minacceleration);
+  adapt->acceleration = adapt->minacceleration;
+  adapt->compressns = 0;
+  adapt->drainns = 0;
+  adapt->avgcompressns = 0;
+  adapt->avgdrainns = 0;
+}
+
+size_t adapt_compress_block(
+    adapt_t* adapt, cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize) {
+  cctx->acceleration = adapt->acceleration;
+  uint64_t start = now_ns();
+  size_t ret = stream_compress_block(cctx, dst, dstsize, src, srcsize);
+  adapt->compressns = now_ns() - start;
+  return ret;
+}
+
+void adapt_drained(adapt_t* adapt, uint64_t drainns) {
+  adapt->drainns = drainns;
+  adapt_update(adapt, adapt->compressns, drainns);
+}
+
+static inline uint64_t moving_average(uint64_t avg, uint64_t sample) {
+  // weight the newest sample at 1/4, so that a single outlier block (e.g. one
+  // that hit a page fault) doesn't swing the acceleration on its own
+  return avg ? (avg * 3 + sample) / 4 : sample;
+}
+
+void adapt_update(adapt_t* adapt, uint64_t compressns, uint64_t drainns) {
+  adapt->avgcompressns = moving_average(adapt->avgcompressns, compressns);
+  adapt->avgdrainns = moving_average(adapt->avgdrainns, drainns);
+
+  // only move when one side is ahead by more than 25%, so that we don't
+  // oscillate when the two are balanced
+  uint64_t c = adapt->avgcompressns;
+  uint64_t d = adapt->avgdrainns;
+  if (d > c + c / 4 && adapt->acceleration > adapt->minacceleration) {
+    // waiting on the output: compress harder
+    adapt->acceleration--;
+  } else if (c > d + d / 4 && adapt->acceleration < adapt->maxacceleration) {
+    // waiting on the compressor: compress faster
+    adapt->acceleration++;
+  }
+}
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
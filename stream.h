@@ -0,0 +1,111 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "compressor.h"
+
+/**
+ * A block stream is a way to compress inputs of unbounded size in bounded
+ * memory. The input is cut into blocks which are each compressed as an
+ * independent message (see compressor.h), and the stream is the
+ * concatenation of those messages, each preceded by a varint of its
+ * compressed size:
+ *
+ *   varint blocksize,
+ *   byte[blocksize] message
+ *
+ * Since every block is compressed separately, the compressor is free to
+ * change its settings from one block to the next. The adaptive mode below
+ * uses that to trade ratio for speed depending on whether the compressor or
+ * the consumer of its output is the bottleneck.
+ */
+
+#define STREAM_BLOCK_SIZE (128 * 1024)
+
+#define ADAPT_MIN_ACCELERATION 1
+#define ADAPT_MAX_ACCELERATION 32
+
+/**
+ * Returns an upper bound on how much space it could take to write a
+ * srcsize-sized block to a stream.
+ */
+size_t stream_block_bound(size_t srcsize);
+
+/**
+ * Compresses src into dst as one stream block.
+ * Returns the number of bytes written, 0 on failure.
+ */
+size_t stream_compress_block(
+    cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize);
+
+/**
+ * Finds the next block in a stream. Points *block at its message and sets
+ * *blocksize to the message's size, and advances the buffer pointer past the
+ * block. Returns whether successful.
+ */
+int stream_read_block(
+    const byte_t** buf, size_t size,
+    const byte_t** block, size_t* blocksize);
+
+/**
+ * State for adapting the compressor's acceleration to the speed at which its
+ * output is drained. After each block is compressed with
+ * adapt_compress_block(), the caller times how long it took to hand the
+ * output off (e.g. to write it to a pipe or socket) and reports that with
+ * adapt_drained().
+ *
+ * If draining consistently takes longer than compressing, the compressor is
+ * waiting on I/O anyway and may as well spend that time compressing harder,
+ * so acceleration moves down. If compressing takes longer, the output link
+ * is sitting idle, so acceleration moves up. It stays within
+ * [minacceleration, maxacceleration].
+ */
+typedef struct {
+  size_t minacceleration;
+  size_t maxacceleration;
+  size_t acceleration;
+  // timings of the last block, in nanoseconds
+  uint64_t compressns;
+  uint64_t drainns;
+  // moving averages of the timings, in nanoseconds
+  uint64_t avgcompressns;
+  uint64_t avgdrainns;
+} adapt_t;
+
+/**
+ * Initializes adaptation state, starting at the slowest (strongest)
+ * acceleration.
+ */
+void adapt_init(adapt_t* adapt, size_t minacceleration, size_t maxacceleration);
+
+/**
+ * Compresses src into dst as one stream block, at the acceleration the
+ * adaptation has settled on, and records how long it took in
+ * adapt->compressns.
+ * Returns the number of bytes written, 0 on failure.
+ */
+size_t adapt_compress_block(
+    adapt_t* adapt, cctx_t* cctx,
+    byte_t* dst, size_t dstsize,
+    const byte_t* src, size_t srcsize);
+
+/**
+ * Reports how long it took to drain the output of the last block, and moves
+ * the acceleration for the next one.
+ */
+void adapt_drained(adapt_t* adapt, uint64_t drainns);
+
+/**
+ * The adaptation policy: folds one block's timings into the averages and
+ * moves the acceleration. Exposed separately from the timing so it can be
+ * driven directly.
+ */
+void adapt_update(adapt_t* adapt, uint64_t compressns, uint64_t drainns);
+
+/**
+ * Monotonic clock, in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+#endif
@@ -0,0 +1,173 @@
+#include "archive.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NUM_FILES 40
+
+char dirpath[] = "/tmp/archive_test.XXXXXX";
+
+void write_file(const char* path, const byte_t* buf, size_t size) {
+  FILE* f = fopen(path, "wb");
+  assert(f);
+  assert(fwrite(buf, 1, size, f) == size);
+  assert(!fclose(f));
+}
+
+size_t file_contents(size_t i, byte_t* buf) {
+  // a mix of sizes, including empty, and of compressible and not
+  size_t size = (i * i * 997) % 50000;
+  uint32_t state = i;
+  for (size_t j = 0; j < size; j++) {
+    state = state * 1103515245 + 12345;
+    buf[j] = i % 2 ? (byte_t) (state >> 16) : (byte_t) ('a' + (j / 7 + i) % 5);
+  }
+  return size;
+}
+
+void make_tree(void) {
+  assert(mkdtemp(dirpath));
+  char path[256];
+  sprintf(path, "%s/sub", dirpath);
+  assert(!mkdir(path, 0700));
+
+  byte_t* buf = malloc(50000);
+  assert(buf);
+  for (size_t i = 0; i < NUM_FILES; i++) {
+    sprintf(path, "%s/%sf%02lu", dirpath, i % 3 ? "" : "sub/", i);
+    write_file(path, buf, file_contents(i, buf));
+  }
+  free(buf);
+}
+
+void remove_tree(void) {
+  char path[256];
+  for (size_t i = 0; i < NUM_FILES; i++) {
+    sprintf(path, "%s/%sf%02lu", dirpath, i % 3 ? "" : "sub/", i);
+    unlink(path);
+  }
+  sprintf(path, "%s/sub", dirpath);
+  rmdir(path);
+  rmdir(dirpath);
+}
+
+void test_archive_roundtrip(int checksum, size_t numthreads) {
+  FILE* archive = tmpfile();
+  assert(archive);
+  const char* paths[] = {dirpath};
+  assert(archive_create(archive, paths, 1, numthreads, checksum));
+
+  archive_index_t index;
+  assert(archive_read_index(archive, &index));
+  assert(index.numentries == NUM_FILES);
+  // directories are walked in name order
+  for (size_t i = 1; i < index.numentries; i++) {
+    assert(strcmp(index.entries[i - 1].name, index.entries[i].name) < 0);
+  }
+
+  byte_t* expected = malloc(50000);
+  assert(expected);
+  char name[256];
+  // extract them out of order, so each one has to be found by seeking
+  for (size_t n = 0; n < NUM_FILES; n++) {
+    size_t i = (n * 7) % NUM_FILES;
+    sprintf(name, "%s/%sf%02lu", dirpath, i % 3 ? "" : "sub/", i);
+    const archive_entry_t* entry = archive_find(&index, name);
+    assert(entry);
+    size_t size = file_contents(i, expected);
+    assert(entry->decompressed_size == size);
+
+    char* out;
+    size_t outsize;
+    FILE* outf = open_memstream(&out, &outsize);
+    assert(outf);
+    assert(archive_extract(archive, entry, outf));
+    assert(!fclose(outf));
+    assert(outsize == size);
+    assert(!memcmp(out, expected, size));
+    free(out);
+  }
+  free(expected);
+
+  assert(!archive_find(&index, "missing"));
+  archive_free_index(&index);
+  fclose(archive);
+}
+
+void test_archive_corrupt(void) {
+  FILE* archive = tmpfile();
+  assert(archive);
+  const char* paths[] = {dirpath};
+  assert(archive_create(archive, paths, 1, 2, 0));
+
+  // anything that isn't an archive is rejected
+  archive_index_t index;
+  assert(!fseek(archive, -1, SEEK_END));
+  fputc('X', archive);
+  assert(!archive_read_index(archive, &index));
+  fclose(archive);
+
+  archive = tmpfile();
+  assert(archive);
+  assert(!archive_read_index(archive, &index));
+  fclose(archive);
+
+  // as are paths that don't exist
+  archive = tmpfile();
+  assert(archive);
+  const char* missing[] = {"/nonexistent/path"};
+  assert(!archive_create(archive, missing, 1, 2, 0));
+  fclose(archive);
+}
+
+void test_archive_corrupt_empty(void) {
+  FILE* archive = tmpfile();
+  assert(archive);
+  const char* paths[] = {dirpath};
+  assert(archive_create(archive, paths, 1, 2, 1));
+  archive_index_t index;
+  assert(archive_read_index(archive, &index));
+
+  // file 0 is empty, but its message still has a header and a checksum
+  char name[256];
+  sprintf(name, "%s/sub/f00", dirpath);
+  const archive_entry_t* entry = archive_find(&index, name);
+  assert(entry);
+  assert(!entry->decompressed_size);
+  FILE* outf = fopen("/dev/null", "wb");
+  assert(outf);
+  assert(archive_extract(archive, entry, outf));
+
+  // trailing junk, here the start of the next message
+  archive_entry_t bad = *entry;
+  bad.compressed_size++;
+  assert(!archive_extract(archive, &bad, outf));
+  // a truncated checksum
+  bad.compressed_size = entry->compressed_size - 1;
+  assert(!archive_extract(archive, &bad, outf));
+  // a bad checksum
+  assert(!fseeko(archive, entry->offset + entry->compressed_size - 1, SEEK_SET));
+  int c = fgetc(archive);
+  assert(c != EOF);
+  assert(!fseeko(archive, entry->offset + entry->compressed_size - 1, SEEK_SET));
+  fputc(c ^ 1, archive);
+  assert(!archive_extract(archive, entry, outf));
+
+  fclose(outf);
+  archive_free_index(&index);
+  fclose(archive);
+}
+
+int main(void) {
+  make_tree();
+  test_archive_roundtrip(0, 1);
+  test_archive_roundtrip(0, 4);
+  test_archive_roundtrip(1, 8);
+  test_archive_corrupt();
+  test_archive_corrupt_empty();
+  remove_tree();
+  return 0;
+}
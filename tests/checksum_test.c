@@ -0,0 +1,88 @@
+#include "checksum.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define BUF_LEN 8192
+
+typedef struct {
+  const char* input;
+  uint64_t expected;
+} checksumtestcase_t;
+
+typedef struct {
+  size_t size;
+  uint64_t expected;
+} checksumsizetestcase_t;
+
+// reference values from the XXH3 implementation
+const checksumtestcase_t tests[] = {
+  {"", 0x2D06800538D394C2ull},
+  {"a", 0xE6C632B61E964E1Full},
+  {"abc", 0x78AF5F94892F3950ull},
+  {"Nobody inspects the spammish repetition", 0x6CB00603B5CC47E9ull},
+};
+
+// and for prefixes of fill_buf()'s content, one either side of each of the
+// boundaries where the way it's hashed changes
+const checksumsizetestcase_t sizetests[] = {
+  {3, 0xC3489259E968AD9Eull},
+  {8, 0xB88DEE77F6BF6980ull},
+  {16, 0x9DA23836ADF2BE1Eull},
+  {128, 0xC39F1D42D786CE20ull},
+  {240, 0x861827A431FE503Cull},
+  {241, 0xBC56E0C024D16050ull},
+  {256, 0x2854EADDF2393D43ull},
+  {257, 0x9F8627ECA0AA377Bull},
+  {1024, 0x7D18FD81BFE82B03ull},
+  {1025, 0x9AD73839621E83CBull},
+  {4096, 0xDCF5273256F049A2ull},
+  {8192, 0x303A033EB9BFCB49ull},
+};
+
+void fill_buf(byte_t* buf) {
+  for (size_t i = 0; i < BUF_LEN; i++) {
+    buf[i] = i * 7 + (i >> 5);
+  }
+}
+
+void test_known_values(void) {
+  const checksumtestcase_t* testsend = tests + (sizeof(tests) / sizeof(tests[0]));
+  for (const checksumtestcase_t* test = tests; test < testsend; test++) {
+    assert(checksum((const byte_t*) test->input, strlen(test->input)) == test->expected);
+  }
+
+  byte_t buf[BUF_LEN];
+  fill_buf(buf);
+  const checksumsizetestcase_t* sizetestsend = sizetests + (sizeof(sizetests) / sizeof(sizetests[0]));
+  for (const checksumsizetestcase_t* test = sizetests; test < sizetestsend; test++) {
+    assert(checksum(buf, test->size) == test->expected);
+  }
+}
+
+void test_incremental(void) {
+  byte_t buf[BUF_LEN];
+  fill_buf(buf);
+
+  // feeding the same content in pieces of any size must give the same result
+  // as feeding it all at once
+  for (size_t size = 0; size < BUF_LEN; size += 137) {
+    uint64_t expected = checksum(buf, size);
+    for (size_t step = 1; step < 1200; step += step < 100 ? 3 : 61) {
+      checksum_t state;
+      checksum_init(&state);
+      for (size_t pos = 0; pos < size; pos += step) {
+        size_t len = pos + step < size ? step : size - pos;
+        checksum_update(&state, buf + pos, len);
+      }
+      assert(checksum_digest(&state) == expected);
+    }
+  }
+}
+
+int main() {
+  test_known_values();
+  test_incremental();
+
+  return 0;
+}
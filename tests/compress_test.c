@@ -1,6 +1,8 @@
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "alloc.h"
 #include "compressor.h"
 #include "compressor_utils.h"
 
@@ -161,12 +163,580 @@ void test_multiple_roundtrip(void) {
   free_cctx(cctx);
 }
 
+void test_batch_roundtrip(void) {
+  const size_t numitems = 16;
+  byte_t srcbufs[numitems][BUF_LEN], dstbufs[numitems][BUF_LEN], buf[BUF_LEN];
+  batchitem_t items[numitems];
+  size_t size1 = strlen(TEST_STRING);
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+
+  for (size_t i = 0; i < numitems; i++) {
+    // vary the contents and lengths of the items
+    memcpy(srcbufs[i], TEST_STRING, size1);
+    srcbufs[i][0] = 'a' + i;
+    items[i].dst = dstbufs[i];
+    items[i].dstsize = BUF_LEN;
+    items[i].src = srcbufs[i];
+    items[i].srcsize = size1 - i;
+  }
+  // one item whose destination is too small to hold it
+  items[numitems - 1].dstsize = 4;
+
+  assert(compress_batch(cctx, items, numitems) == numitems - 1);
+  assert(!items[numitems - 1].result);
+
+  for (size_t i = 0; i < numitems - 1; i++) {
+    assert(items[i].result);
+    size_t size = decompress(buf, BUF_LEN, items[i].dst, items[i].result);
+    assert(size == items[i].srcsize);
+    assert(!memcmp(buf, items[i].src, size));
+  }
+
+  free_cctx(cctx);
+}
+
+void test_checksum_roundtrip(void) {
+  byte_t buf1[LONG_BUF_LEN], buf2[LONG_BUF_LEN], buf3[LONG_BUF_LEN];
+  size_t size1 = strlen(LONG_TEST_STRING);
+  size_t size2;
+  size_t size3;
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  cctx->checksum = 1;
+
+  memcpy(buf1, LONG_TEST_STRING, size1);
+
+  size2 = compress(cctx, buf2, LONG_BUF_LEN, buf1, size1);
+  assert(size2);
+
+  size3 = decompress(buf3, LONG_BUF_LEN, buf2, size2);
+  assert(size3 == size1);
+  assert(!memcmp(buf1, buf3, size1));
+
+  // corrupt one byte of the last literal, which leaves the stream
+  // structurally valid
+  buf2[size2 - CHECKSUM_SIZE - 2] ^= 0x20;
+  assert(!decompress(buf3, LONG_BUF_LEN, buf2, size2));
+  buf2[size2 - CHECKSUM_SIZE - 2] ^= 0x20;
+
+  // and the checksum itself
+  buf2[size2 - 1] ^= 1;
+  assert(!decompress(buf3, LONG_BUF_LEN, buf2, size2));
+
+  free_cctx(cctx);
+}
+
+void test_reference_roundtrip(void) {
+  byte_t ref[LONG_BUF_LEN], buf1[LONG_BUF_LEN], buf2[LONG_BUF_LEN], buf3[LONG_BUF_LEN];
+  size_t refsize = strlen(LONG_TEST_STRING);
+  size_t size1;
+  size_t size2;
+  size_t size3;
+  size_t standalone_size;
+
+  memcpy(ref, LONG_TEST_STRING, refsize);
+
+  // the "new version": the reference with a few edits
+  memcpy(buf1, ref, 1000);
+  memcpy(buf1 + 1000, "an edit", 7);
+  memcpy(buf1 + 1007, ref + 1000, refsize - 2000);
+  size1 = refsize - 993;
+
+  cctx_t* cctx = make_cctx_sized(TABLE_SIZE_LOG + 2);
+  assert(cctx);
+
+  standalone_size = compress(cctx, buf2, LONG_BUF_LEN, buf1, size1);
+  assert(standalone_size);
+
+  assert(cctx_load_reference(cctx, ref, refsize));
+  size2 = compress(cctx, buf2, LONG_BUF_LEN, buf1, size1);
+  assert(size2);
+  assert(size2 * 20 < standalone_size);
+
+  size3 = decompress_with_reference(buf3, LONG_BUF_LEN, buf2, size2, ref, refsize);
+  assert(size3 == size1);
+  assert(!memcmp(buf1, buf3, size1));
+
+  // the reference is required
+  assert(!decompress(buf3, LONG_BUF_LEN, buf2, size2));
+
+  // and it's used up by the compression
+  size2 = compress(cctx, buf2, LONG_BUF_LEN, buf1, size1);
+  assert(size2);
+  size3 = decompress(buf3, LONG_BUF_LEN, buf2, size2);
+  assert(size3 == size1);
+  assert(!memcmp(buf1, buf3, size1));
+
+  free_cctx(cctx);
+}
+
+void test_reference_manual_seqs(void) {
+  byte_t cbuf[BUF_LEN], dbuf[BUF_LEN];
+  size_t csize, dsize;
+
+  // a match entirely in the reference
+  const litandmatch_t seq1[] = {{1, "x", 1, 2}};
+  csize = encode_literals_and_matches(cbuf, sizeof(cbuf), seq1, 1);
+  dsize = decompress_with_reference(dbuf, sizeof(dbuf), cbuf, csize, (const byte_t*) "abcd", 4);
+  assert(dsize == 3);
+  assert(!memcmp(dbuf, "xcd", 3));
+
+  // a match that runs from the reference into the output
+  const litandmatch_t seq2[] = {{1, "x", 0, 3}};
+  csize = encode_literals_and_matches(cbuf, sizeof(cbuf), seq2, 1);
+  dsize = decompress_with_reference(dbuf, sizeof(dbuf), cbuf, csize, (const byte_t*) "ab", 2);
+  assert(dsize == 4);
+  assert(!memcmp(dbuf, "xabx", 4));
+
+  // a match that reaches back past the start of the reference
+  const litandmatch_t seq3[] = {{1, "x", 0, 4}};
+  csize = encode_literals_and_matches(cbuf, sizeof(cbuf), seq3, 1);
+  assert(!decompress_with_reference(dbuf, sizeof(dbuf), cbuf, csize, (const byte_t*) "ab", 2));
+}
+
+void test_large_alloc_roundtrip(void) {
+  byte_t buf1[LONG_BUF_LEN], buf2[LONG_BUF_LEN], buf3[LONG_BUF_LEN];
+  size_t size1 = strlen(LONG_TEST_STRING);
+  size_t size2;
+  size_t size3;
+
+  // big enough to span several huge pages
+  cctx_t* cctx = make_cctx_with_flags(20, ALLOC_HUGE_PAGES | ALLOC_LOCAL_NODE);
+  assert(cctx);
+
+  memcpy(buf1, LONG_TEST_STRING, size1);
+
+  for (int i = 0; i < 3; i++) {
+    size2 = compress(cctx, buf2, LONG_BUF_LEN, buf1, size1);
+    assert(size2);
+
+    size3 = decompress(buf3, LONG_BUF_LEN, buf2, size2);
+    assert(size3 == size1);
+    assert(!memcmp(buf1, buf3, size1));
+  }
+
+  free_cctx(cctx);
+
+  // growing a buffer keeps its contents
+  byte_t* buf = large_alloc(100, ALLOC_HUGE_PAGES);
+  assert(buf);
+  memcpy(buf, TEST_STRING, strlen(TEST_STRING));
+  buf = large_realloc(buf, 100, 3 * HUGE_PAGE_SIZE, ALLOC_HUGE_PAGES);
+  assert(buf);
+  assert(!memcmp(buf, TEST_STRING, strlen(TEST_STRING)));
+  assert(!buf[3 * HUGE_PAGE_SIZE - 1]);
+  large_free(buf, 3 * HUGE_PAGE_SIZE, ALLOC_HUGE_PAGES);
+
+  // and like realloc(), growing nothing allocates
+  buf = large_realloc(NULL, 0, 100, ALLOC_LOCAL_NODE);
+  assert(buf);
+  assert(!buf[99]);
+  large_free(buf, 100, ALLOC_LOCAL_NODE);
+}
+
+void test_sequences_roundtrip(void) {
+  byte_t buf1[LONG_BUF_LEN], buf2[LONG_BUF_LEN], buf3[LONG_BUF_LEN], buf4[LONG_BUF_LEN];
+  size_t size1 = strlen(LONG_TEST_STRING);
+  size_t size2;
+  size_t size3;
+  size_t size4;
+
+  memcpy(buf1, LONG_TEST_STRING, size1);
+
+  // finding sequences and then compressing them gives the same result as
+  // compressing in one go
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  size2 = compress(cctx, buf2, LONG_BUF_LEN, buf1, size1);
+  assert(size2);
+  free_cctx(cctx);
+
+  cctx = make_cctx();
+  assert(cctx);
+  lambuf_t lams = {NULL, 0, 0, 1};
+  assert(find_sequences(cctx, &lams, buf1, size1));
+  assert(lams.numlams > 1);
+  size3 = compress_sequences(cctx, buf3, LONG_BUF_LEN, buf1, size1, lams.lams, lams.numlams);
+  assert(size3 == size2);
+  assert(!memcmp(buf2, buf3, size2));
+
+  // and the same sequences can be encoded again with different settings
+  cctx->checksum = 1;
+  size3 = compress_sequences(cctx, buf3, LONG_BUF_LEN, buf1, size1, lams.lams, lams.numlams);
+  assert(size3 == size2 + CHECKSUM_SIZE);
+  size4 = decompress(buf4, LONG_BUF_LEN, buf3, size3);
+  assert(size4 == size1);
+  assert(!memcmp(buf1, buf4, size1));
+
+  // a fixed-size buffer that's too small fails rather than growing
+  litandmatch_t few[2];
+  lambuf_t fixed = {few, 0, 2, 0};
+  assert(!find_sequences(cctx, &fixed, buf1, size1));
+
+  // sequences that don't describe the source are rejected
+  assert(!compress_sequences(cctx, buf3, LONG_BUF_LEN, buf1, size1 - 1, lams.lams, lams.numlams));
+  assert(!compress_sequences(cctx, buf3, LONG_BUF_LEN, buf1, size1, lams.lams, lams.numlams - 1));
+  lams.lams[1].match_offset = size1;
+  assert(!compress_sequences(cctx, buf3, LONG_BUF_LEN, buf1, size1, lams.lams, lams.numlams));
+
+  free(lams.lams);
+  free_cctx(cctx);
+}
+
+void test_external_sequences(void) {
+  byte_t cbuf[BUF_LEN], dbuf[BUF_LEN];
+  const char* src = "abcdabcdabcdxyz";
+  size_t srcsize = strlen(src);
+  // a "domain-specific" parse: a literal run, two repeats of it, and some
+  // trailing literals
+  const litandmatch_t seq[] = {
+    {4, NULL, 0, 4},
+    {0, NULL, 4, 4},
+    {3, NULL, 0, 0},
+  };
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  size_t csize = compress_sequences(cctx, cbuf, BUF_LEN, (const byte_t*) src, srcsize, seq, 3);
+  assert(csize);
+  size_t dsize = decompress(dbuf, BUF_LEN, cbuf, csize);
+  assert(dsize == srcsize);
+  assert(!memcmp(dbuf, src, srcsize));
+  free_cctx(cctx);
+}
+
+/**
+ * Compresses src, moves the result to the end of a buffer just the
+ * guaranteed margin bigger than src, and decompresses it there.
+ */
+void check_inplace_roundtrip(cctx_t* cctx, const byte_t* src, size_t srcsize) {
+  size_t cbufsize = compressed_size_bound(srcsize);
+  byte_t* cbuf = malloc(cbufsize);
+  assert(cbuf);
+  size_t csize = compress(cctx, cbuf, cbufsize, src, srcsize);
+  assert(csize);
+
+  size_t bufsize = srcsize + decompress_inplace_margin(srcsize);
+  assert(csize <= bufsize);
+  byte_t* buf = malloc(bufsize);
+  assert(buf);
+  memcpy(buf + bufsize - csize, cbuf, csize);
+  assert(decompress_inplace(buf, bufsize, csize) == srcsize);
+  assert(!memcmp(buf, src, srcsize));
+
+  free(buf);
+  free(cbuf);
+}
+
+void test_inplace_roundtrip(void) {
+  const size_t srcsize = 256 * 1024;
+  byte_t* src = malloc(srcsize);
+  assert(src);
+
+  // incompressible, then with short repeats mixed in, then one long run
+  uint32_t state = 1;
+  for (size_t i = 0; i < srcsize; i++) {
+    state = state * 1103515245 + 12345;
+    src[i] = state >> 16;
+  }
+  byte_t* mixed = src + srcsize / 4;
+  for (size_t i = 64; i < srcsize / 4; i += 16) {
+    memcpy(mixed + i, mixed + i - (i * 7) % 61 - 8, 6);
+  }
+  memset(src + srcsize / 2, 'a', srcsize / 4);
+  memcpy(src + 3 * srcsize / 4, LONG_TEST_STRING, strlen(LONG_TEST_STRING));
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  for (int checksum = 0; checksum <= 1; checksum++) {
+    for (size_t acceleration = 1; acceleration <= 8; acceleration *= 8) {
+      cctx->checksum = checksum;
+      cctx->acceleration = acceleration;
+      check_inplace_roundtrip(cctx, (const byte_t*) "", 0);
+      check_inplace_roundtrip(cctx, (const byte_t*) TEST_STRING, strlen(TEST_STRING));
+      check_inplace_roundtrip(cctx, src, srcsize / 4);
+      check_inplace_roundtrip(cctx, mixed, srcsize / 4);
+      check_inplace_roundtrip(cctx, src + srcsize / 2, srcsize / 4);
+      check_inplace_roundtrip(cctx, src, srcsize);
+    }
+  }
+  free_cctx(cctx);
+  free(src);
+}
+
+void test_inplace_sequences(void) {
+  // every other byte is a one-byte match far back, which costs more to
+  // encode than it saves, and has to be folded into the literals
+  const size_t srcsize = 4096;
+  byte_t src[srcsize];
+  litandmatch_t seq[srcsize];
+  size_t numseqs = 0;
+  for (size_t i = 0; i < srcsize; i++) {
+    src[i] = i * 31 + (i >> 5);
+  }
+  seq[numseqs++] = (litandmatch_t) {1024, NULL, 0, 0};
+  for (size_t i = 1024; i < srcsize; i += 2) {
+    src[i + 1] = src[i + 1 - 1000 - 1];
+    seq[numseqs - 1].match_offset = 1000;
+    seq[numseqs - 1].match_length = 1;
+    seq[numseqs++] = (litandmatch_t) {1, NULL, 0, 0};
+  }
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  size_t bufsize = srcsize + decompress_inplace_margin(srcsize);
+  byte_t* buf = malloc(bufsize);
+  byte_t* cbuf = malloc(compressed_size_bound(srcsize));
+  assert(buf && cbuf);
+  size_t csize = compress_sequences(cctx, cbuf, compressed_size_bound(srcsize), src, srcsize, seq, numseqs);
+  assert(csize && csize <= bufsize);
+  memcpy(buf + bufsize - csize, cbuf, csize);
+  assert(decompress_inplace(buf, bufsize, csize) == srcsize);
+  assert(!memcmp(buf, src, srcsize));
+
+  free(cbuf);
+  free(buf);
+  free_cctx(cctx);
+}
+
+void test_inplace_rejects_overlap(void) {
+  // a long match up front, then lots of sequences that each take more to
+  // encode than they produce: valid, but the output would overrun the input
+  byte_t lits[100];
+  memset(lits, 'a', sizeof(lits));
+  litandmatch_t seq[32];
+  seq[0] = (litandmatch_t) {100, lits, 0, 100};
+  for (size_t i = 1; i < 32; i++) {
+    seq[i] = (litandmatch_t) {1, (const byte_t*) "b", 0, 1};
+  }
+  byte_t src[4 * BUF_LEN];
+  size_t csize = encode_literals_and_matches(src, sizeof(src), seq, 32);
+  assert(csize);
+
+  size_t dsize = 200 + 31 * 2;
+  byte_t dbuf[dsize];
+  assert(decompress(dbuf, dsize, src, csize) == dsize);
+
+  size_t bufsize = dsize + decompress_inplace_margin(dsize);
+  byte_t buf[bufsize];
+  memcpy(buf + bufsize - csize, src, csize);
+  assert(!decompress_inplace(buf, bufsize, csize));
+}
+
+void test_small_roundtrip(void) {
+  const size_t sizes[] = {0, 1, 4, 5, 63, 64, 65, 200, 1000, 4095, SMALL_INPUT_MAX, SMALL_INPUT_MAX + 1};
+  const size_t numsizes = sizeof(sizes) / sizeof(sizes[0]);
+  const byte_t* text = (const byte_t*) LONG_TEST_STRING;
+  assert(strlen(LONG_TEST_STRING) > SMALL_INPUT_MAX + 1);
+  byte_t cbuf[2 * SMALL_INPUT_MAX + 64];
+  byte_t dbuf[SMALL_INPUT_MAX + 1];
+
+  cctx_t* cctx = make_cctx();
+  cctx_t* fresh = make_cctx();
+  assert(cctx && fresh);
+  lambuf_t lams = {NULL, 0, 0, 1};
+  for (int checksum = 0; checksum <= 1; checksum++) {
+    cctx->checksum = checksum;
+    fresh->checksum = checksum;
+    for (size_t i = 0; i < numsizes; i++) {
+      size_t srcsize = sizes[i];
+      const byte_t* src = text + i * 7;
+
+      size_t csize = compress(cctx, cbuf, sizeof(cbuf), src, srcsize);
+      assert(csize);
+      assert(decompress(dbuf, sizeof(dbuf), cbuf, csize) == srcsize);
+      assert(!memcmp(dbuf, src, srcsize));
+      if (srcsize <= SMALL_INPUT_MAX) {
+        assert(cctx->numsmalltouched <= srcsize);
+      }
+
+      // clearing only the touched entries leaves the table as good as new,
+      // so a reused context gives the same output as a fresh one
+      byte_t fbuf[sizeof(cbuf)];
+      free_cctx(fresh);
+      fresh = make_cctx();
+      assert(fresh);
+      fresh->checksum = checksum;
+      assert(compress(fresh, fbuf, sizeof(fbuf), src, srcsize) == csize);
+      if (srcsize <= SMALL_INPUT_MAX) {
+        assert(!memcmp(fbuf, cbuf, csize));
+        // and never needed the main table
+        assert(!fresh->table);
+      }
+
+      assert(find_sequences(cctx, &lams, src, srcsize));
+      csize = compress_sequences(cctx, cbuf, sizeof(cbuf), src, srcsize, lams.lams, lams.numlams);
+      assert(csize);
+      assert(decompress(dbuf, sizeof(dbuf), cbuf, csize) == srcsize);
+      assert(!memcmp(dbuf, src, srcsize));
+    }
+  }
+  free(lams.lams);
+  free_cctx(fresh);
+  free_cctx(cctx);
+}
+
+void test_small_failure_reuse(void) {
+  const byte_t* text = (const byte_t*) LONG_TEST_STRING;
+  byte_t cbuf[2 * SMALL_INPUT_MAX + 64], fbuf[sizeof(cbuf)];
+  byte_t tiny[16];
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  // runs out of room partway through, after filling in some of the table
+  assert(!compress(cctx, tiny, sizeof(tiny), text, SMALL_INPUT_MAX));
+  size_t numfilled = 0;
+  for (size_t i = 0; i < ((size_t) 1 << SMALL_TABLE_SIZE_LOG); i++) {
+    numfilled += cctx->smalltable[i] != 0;
+  }
+  assert(numfilled);
+  assert(cctx->numsmalltouched == numfilled);
+
+  // so the next call starts from a clean table, for all that the last one
+  // failed
+  for (size_t i = 1; i <= 3; i++) {
+    const byte_t* src = text + i * 101;
+    size_t srcsize = SMALL_INPUT_MAX / i;
+    size_t csize = compress(cctx, cbuf, sizeof(cbuf), src, srcsize);
+    assert(csize);
+    cctx_t* fresh = make_cctx();
+    assert(fresh);
+    assert(compress(fresh, fbuf, sizeof(fbuf), src, srcsize) == csize);
+    assert(!memcmp(fbuf, cbuf, csize));
+    free_cctx(fresh);
+  }
+  free_cctx(cctx);
+}
+
+void test_failure_reuse(void) {
+  // a call that gives up partway through has still stored positions in the
+  // table, which the next call mustn't be able to see. The next call skips
+  // ahead, so it would find matches among them that a fresh context can't.
+  const byte_t* src = (const byte_t*) LONG_TEST_STRING;
+  size_t srcsize = strlen(LONG_TEST_STRING);
+  assert(srcsize > SMALL_INPUT_MAX);
+  byte_t cbuf[LONG_BUF_LEN], fbuf[LONG_BUF_LEN];
+  byte_t tiny[srcsize / 2];
+
+  for (int checksum = 0; checksum <= 1; checksum++) {
+    cctx_t* cctx = make_cctx();
+    assert(cctx);
+    cctx->checksum = checksum;
+    size_t tableoffset = cctx->tableoffset;
+    assert(!compress(cctx, tiny, sizeof(tiny), src, srcsize));
+    assert(cctx->tableoffset == tableoffset + srcsize);
+
+    cctx->acceleration = 8;
+    size_t csize = compress(cctx, cbuf, LONG_BUF_LEN, src, srcsize);
+    assert(csize);
+    cctx_t* fresh = make_cctx();
+    assert(fresh);
+    fresh->checksum = checksum;
+    fresh->acceleration = 8;
+    assert(compress(fresh, fbuf, LONG_BUF_LEN, src, srcsize) == csize);
+    assert(!memcmp(fbuf, cbuf, csize));
+    free_cctx(fresh);
+    free_cctx(cctx);
+  }
+}
+
+void test_sequences_reuse_matches_compress(void) {
+  // a reused context's table holds positions from earlier calls, which must
+  // all be out of reach afterwards, however those calls were made
+  const byte_t* text = (const byte_t*) LONG_TEST_STRING;
+  size_t srcsize = strlen(LONG_TEST_STRING) - 4 * 97;
+  assert(srcsize > SMALL_INPUT_MAX);
+  byte_t cbuf1[LONG_BUF_LEN], cbuf2[LONG_BUF_LEN];
+
+  cctx_t* cctx1 = make_cctx();
+  cctx_t* cctx2 = make_cctx();
+  assert(cctx1 && cctx2);
+  lambuf_t lams = {NULL, 0, 0, 1};
+  for (size_t i = 0; i < 4; i++) {
+    const byte_t* src = text + i * 97;
+    size_t csize1 = compress(cctx1, cbuf1, LONG_BUF_LEN, src, srcsize);
+    assert(csize1);
+    assert(find_sequences(cctx2, &lams, src, srcsize));
+    size_t csize2 = compress_sequences(cctx2, cbuf2, LONG_BUF_LEN, src, srcsize, lams.lams, lams.numlams);
+    assert(csize2 == csize1);
+    assert(!memcmp(cbuf1, cbuf2, csize1));
+    assert(cctx1->tableoffset == cctx2->tableoffset);
+  }
+  free(lams.lams);
+  free_cctx(cctx2);
+  free_cctx(cctx1);
+}
+
+void test_table_offset_wrap(void) {
+  const byte_t* src = (const byte_t*) LONG_TEST_STRING;
+  size_t srcsize = strlen(LONG_TEST_STRING);
+  assert(srcsize > SMALL_INPUT_MAX);
+  byte_t cbuf[LONG_BUF_LEN], dbuf[LONG_BUF_LEN];
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  assert(compress(cctx, cbuf, LONG_BUF_LEN, src, srcsize));
+  // as though it had compressed nearly enough to overflow the positions
+  cctx->tableoffset = SIZE_MAX / 2 - 10;
+  for (int i = 0; i < 2; i++) {
+    size_t csize = compress(cctx, cbuf, LONG_BUF_LEN, src, srcsize);
+    assert(csize);
+    assert(cctx->tableoffset < SIZE_MAX / 2);
+    assert(decompress(dbuf, LONG_BUF_LEN, cbuf, csize) == srcsize);
+    assert(!memcmp(dbuf, src, srcsize));
+  }
+  free_cctx(cctx);
+}
+
+void test_verify_empty_message(void) {
+  byte_t cbuf[BUF_LEN];
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  for (int checksum = 0; checksum <= 1; checksum++) {
+    cctx->checksum = checksum;
+    size_t csize = compress(cctx, cbuf, BUF_LEN, (const byte_t*) "", 0);
+    assert(csize);
+    assert(decompressed_size(cbuf, csize) == 0);
+    assert(verify_empty_message(cbuf, csize, NULL, 0));
+    // trailing junk, or a truncated checksum
+    cbuf[csize] = 'x';
+    assert(!verify_empty_message(cbuf, csize + 1, NULL, 0) || checksum);
+    assert(!verify_empty_message(cbuf, csize - checksum, NULL, 0) || !checksum);
+  }
+  // says it's empty, but has literals
+  assert(!verify_empty_message((const byte_t*) "\x00\x05" "abc", 5, NULL, 0));
+  // isn't empty
+  assert(!verify_empty_message((const byte_t*) "\x04\x01" "a", 3, NULL, 0));
+  // no header at all
+  assert(!verify_empty_message(cbuf, 0, NULL, 0));
+  free_cctx(cctx);
+}
+
 int main() {
   test_simple_roundtrip();
   test_long_roundtrip();
   test_noop_roundtrip();
   test_multiple_roundtrip();
+  test_batch_roundtrip();
+  test_checksum_roundtrip();
+  test_reference_roundtrip();
+  test_reference_manual_seqs();
+  test_large_alloc_roundtrip();
+  test_sequences_roundtrip();
+  test_external_sequences();
   test_manual_seqs();
+  test_inplace_roundtrip();
+  test_inplace_sequences();
+  test_inplace_rejects_overlap();
+  test_small_roundtrip();
+  test_small_failure_reuse();
+  test_failure_reuse();
+  test_sequences_reuse_matches_compress();
+  test_table_offset_wrap();
+  test_verify_empty_message();
 
   return 0;
 }
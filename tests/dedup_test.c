@@ -0,0 +1,147 @@
+#include "dedup.h"
+#include "varint.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+const size_t REGION_LEN = 256 * 1024;
+
+void fill_random(byte_t* buf, size_t size, uint32_t seed) {
+  // incompressible on its own, so that any savings come from dedup
+  uint32_t state = seed;
+  for (size_t i = 0; i < size; i++) {
+    state = state * 1103515245 + 12345;
+    buf[i] = state >> 16;
+  }
+}
+
+void test_chunk_lengths(void) {
+  byte_t* buf = malloc(REGION_LEN);
+  assert(buf);
+  fill_random(buf, REGION_LEN, 1);
+
+  size_t pos = 0;
+  while (pos < REGION_LEN) {
+    size_t len = dedup_chunk_length(buf + pos, REGION_LEN - pos);
+    assert(len);
+    assert(len <= DEDUP_MAX_CHUNK);
+    assert(len >= DEDUP_MIN_CHUNK || pos + len == REGION_LEN);
+    pos += len;
+  }
+  assert(pos == REGION_LEN);
+
+  free(buf);
+}
+
+void test_dedup_roundtrip(void) {
+  // a region, something else, the region again after a few inserted bytes,
+  // and the region once more
+  size_t srcsize = 4 * REGION_LEN + 3;
+  byte_t* src = malloc(srcsize);
+  assert(src);
+  byte_t* region = src;
+  fill_random(region, REGION_LEN, 1);
+  fill_random(src + REGION_LEN, REGION_LEN, 2);
+  memcpy(src + 2 * REGION_LEN, "abc", 3);
+  memcpy(src + 2 * REGION_LEN + 3, region, REGION_LEN);
+  memcpy(src + 3 * REGION_LEN + 3, region, REGION_LEN);
+
+  size_t dstsize = dedup_compressed_size_bound(srcsize);
+  byte_t* dst = malloc(dstsize);
+  byte_t* out = malloc(srcsize);
+  assert(dst && out);
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+
+  size_t csize = dedup_compress(cctx, dst, dstsize, src, srcsize);
+  assert(csize);
+  // the repeats should cost next to nothing, even though the first one is
+  // shifted
+  assert(csize < 2 * REGION_LEN + REGION_LEN / 8);
+
+  assert(dedup_decompressed_size(dst, csize) == srcsize);
+  assert(dedup_decompress(out, srcsize, dst, csize) == srcsize);
+  assert(!memcmp(src, out, srcsize));
+
+  // too small a destination must be rejected
+  assert(!dedup_decompress(out, srcsize - 1, dst, csize));
+
+  free_cctx(cctx);
+  free(out);
+  free(dst);
+  free(src);
+}
+
+void test_dedup_empty(void) {
+  byte_t dst[64];
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  size_t csize = dedup_compress(cctx, dst, sizeof(dst), (const byte_t*) "", 0);
+  assert(csize);
+  assert(dedup_decompressed_size(dst, csize) == 0);
+  assert(dedup_verify_empty(dst, csize));
+
+  // an empty size followed by junk, and nothing at all
+  assert(!dedup_verify_empty((const byte_t*) "\x00garbage", 8));
+  assert(!dedup_verify_empty(dst, 0));
+  free_cctx(cctx);
+}
+
+void test_dedup_checksum(void) {
+  size_t srcsize = 2 * REGION_LEN;
+  byte_t* src = malloc(srcsize);
+  assert(src);
+  fill_random(src, REGION_LEN, 1);
+  memcpy(src + REGION_LEN, src, REGION_LEN);
+
+  size_t dstsize = dedup_compressed_size_bound(srcsize);
+  byte_t* dst = malloc(dstsize);
+  byte_t* out = malloc(srcsize);
+  assert(dst && out);
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  cctx->checksum = 1;
+  size_t csize = dedup_compress(cctx, dst, dstsize, src, srcsize);
+  assert(csize);
+  assert(cctx->checksum);
+  assert(dedup_decompress(out, srcsize, dst, csize) == srcsize);
+  assert(!memcmp(src, out, srcsize));
+
+  // find the first duplicate chunk in the recipe and nudge its offset, which
+  // still points inside the output, so only the checksum can catch it
+  const byte_t* p = dst;
+  uint64_t val, numchunks;
+  assert(varint_decode(&p, csize, &val));
+  assert(varint_decode(&p, dst + csize - p, &numchunks));
+  for (;;) {
+    assert(numchunks--);
+    assert(varint_decode(&p, dst + csize - p, &val));
+    if (val & 1) {
+      break;
+    }
+  }
+  dst[p - dst] ^= 1;
+  assert(!dedup_decompress(out, srcsize, dst, csize));
+  dst[p - dst] ^= 1;
+
+  // and the trailer itself
+  dst[csize - 1] ^= 0x80;
+  assert(!dedup_decompress(out, srcsize, dst, csize));
+
+  free_cctx(cctx);
+  free(out);
+  free(dst);
+  free(src);
+}
+
+int main() {
+  test_chunk_lengths();
+  test_dedup_roundtrip();
+  test_dedup_empty();
+  test_dedup_checksum();
+
+  return 0;
+}
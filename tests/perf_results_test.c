@@ -0,0 +1,142 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "perf_results.h"
+
+#define MAX_TEST_RESULTS 16
+
+static size_t read_string(const char* baseline, result_t* results) {
+  FILE* f = fmemopen((void*) baseline, strlen(baseline), "r");
+  assert(f);
+  size_t numresults;
+  assert(read_baseline(f, results, MAX_TEST_RESULTS, &numresults));
+  fclose(f);
+  return numresults;
+}
+
+static void make_result(result_t* result, const char* corpus, const char* op, size_t acceleration) {
+  strcpy(result->corpus, corpus);
+  strcpy(result->op, op);
+  result->acceleration = acceleration;
+  for (size_t i = 0; i < NUM_METRICS; i++) {
+    result->metrics[i] = 100 * (i + 1);
+  }
+}
+
+void test_roundtrip(void) {
+  result_t results[2];
+  make_result(&results[0], "corpus/a \\\"b\\\"", "compress", 1);
+  make_result(&results[1], "corpus/a \\\"b\\\"", "decompress", 4);
+  results[0].metrics[2] = 0.125;
+  results[1].metrics[3] = -1;
+
+  char buf[4096];
+  FILE* f = fmemopen(buf, sizeof(buf), "w");
+  assert(f);
+  fprintf(f, "{\"reps\": 5, \"results\": [\n");
+  print_result(f, &results[0], 0);
+  print_result(f, &results[1], 1);
+  fprintf(f, "]}\n");
+  fclose(f);
+
+  result_t read[MAX_TEST_RESULTS];
+  assert(read_string(buf, read) == 2);
+  for (size_t r = 0; r < 2; r++) {
+    assert(!strcmp(read[r].corpus, results[r].corpus));
+    assert(!strcmp(read[r].op, results[r].op));
+    assert(read[r].acceleration == results[r].acceleration);
+    assert(!memcmp(read[r].metrics, results[r].metrics, sizeof(results[r].metrics)));
+  }
+  assert(!compare_results(results, 2, read, 2, 0));
+}
+
+void test_malformed_baseline(void) {
+  result_t read[MAX_TEST_RESULTS];
+  assert(read_string("", read) == 0);
+  assert(read_string("not json at all\n{}\n]}\n", read) == 0);
+
+  // lines that can't be made sense of are skipped, and the rest still read
+  const char* baseline =
+      "{\"reps\": 5, \"results\": [\n"
+      "  {\"corpus\": \"unterminated, \"op\n"
+      "  {\"corpus\": \"x\", \"op\": \"COMPRESS\", \"acceleration\": 1, \"cycles\": 1},\n"
+      "  {\"corpus\": \"x\", \"op\": \"compress\", \"acceleration\": many, \"cycles\": 1},\n"
+      "  {\"corpus\": \"x\", \"op\": \"compress\"},\n"
+      "  {\"corpus\": \"x\", \"op\": \"compress\", \"acceleration\": 2, \"cycles\": lots, \"ns\": 3}\n"
+      "]}\n";
+  assert(read_string(baseline, read) == 1);
+  assert(!strcmp(read[0].corpus, "x"));
+  assert(!strcmp(read[0].op, "compress"));
+  assert(read[0].acceleration == 2);
+  assert(read[0].metrics[0] < 0);
+  assert(read[0].metrics[NUM_COUNTERS] == 3);
+
+  // a corpus name too long to hold
+  char longline[MAX_NAME_SIZE + 128];
+  strcpy(longline, "  {\"corpus\": \"");
+  memset(longline + strlen(longline), 'a', MAX_NAME_SIZE);
+  strcpy(longline + strlen("  {\"corpus\": \"") + MAX_NAME_SIZE, "\", \"op\": \"compress\", \"acceleration\": 1}\n");
+  assert(read_string(longline, read) == 0);
+}
+
+void test_missing_key(void) {
+  result_t read[MAX_TEST_RESULTS];
+  const char* baseline =
+      "  {\"corpus\": \"x\", \"op\": \"compress\", \"acceleration\": 1, \"cycles\": 100, \"ns\": null}\n";
+  assert(read_string(baseline, read) == 1);
+  assert(read[0].metrics[0] == 100);
+  for (size_t i = 1; i < NUM_METRICS; i++) {
+    assert(read[0].metrics[i] < 0);
+  }
+
+  // metrics the baseline lacks can't regress, however bad they are
+  result_t cur;
+  make_result(&cur, "x", "compress", 1);
+  cur.metrics[0] = 100;
+  for (size_t i = 1; i < NUM_METRICS; i++) {
+    cur.metrics[i] = 1e12;
+  }
+  assert(compare_results(&cur, 1, read, 1, 0.05) == 0);
+  cur.metrics[0] = 1e12;
+  assert(compare_results(&cur, 1, read, 1, 0.05) == 1);
+
+  // and nor can results the baseline has nothing to compare with
+  make_result(&cur, "x", "decompress", 1);
+  assert(compare_results(&cur, 1, read, 1, 0.05) == 0);
+  make_result(&cur, "x", "compress", 2);
+  assert(compare_results(&cur, 1, read, 1, 0.05) == 0);
+}
+
+void test_threshold(void) {
+  result_t base, cur;
+  make_result(&base, "x", "compress", 1);
+  make_result(&cur, "x", "compress", 1);
+
+  // better, or worse by less than the threshold
+  cur.metrics[0] = base.metrics[0] / 2;
+  cur.metrics[1] = base.metrics[1] * 1.04;
+  assert(compare_results(&cur, 1, &base, 1, 0.05) == 0);
+
+  // worse by more than the threshold
+  cur.metrics[1] = base.metrics[1] * 1.06;
+  assert(compare_results(&cur, 1, &base, 1, 0.05) == 1);
+  cur.metrics[NUM_METRICS - 1] = base.metrics[NUM_METRICS - 1] * 2;
+  assert(compare_results(&cur, 1, &base, 1, 0.05) == 2);
+  assert(compare_results(&cur, 1, &base, 1, 1.5) == 0);
+
+  // any increase at all from a baseline of 0
+  base.metrics[0] = cur.metrics[0] = 0;
+  assert(compare_results(&cur, 1, &base, 1, 1.5) == 0);
+  cur.metrics[0] = 1;
+  assert(compare_results(&cur, 1, &base, 1, 1.5) == 1);
+}
+
+int main() {
+  test_roundtrip();
+  test_malformed_baseline();
+  test_missing_key();
+  test_threshold();
+
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include "stream.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+const size_t SRC_LEN = 3 * STREAM_BLOCK_SIZE + 1234;
+
+void fill_test_input(byte_t* buf, size_t size) {
+  // something compressible, but not trivially so
+  uint32_t state = 1;
+  for (size_t i = 0; i < size; i++) {
+    state = state * 1103515245 + 12345;
+    buf[i] = "abcdefgh"[(state >> 16) & 7];
+  }
+}
+
+void test_stream_roundtrip(size_t acceleration) {
+  byte_t* src = malloc(SRC_LEN);
+  size_t dstsize = 4 * stream_block_bound(STREAM_BLOCK_SIZE);
+  byte_t* dst = malloc(dstsize);
+  byte_t* out = malloc(SRC_LEN);
+  assert(src && dst && out);
+  fill_test_input(src, SRC_LEN);
+
+  cctx_t* cctx = make_cctx();
+  assert(cctx);
+  cctx->acceleration = acceleration;
+
+  byte_t* dstp = dst;
+  for (size_t pos = 0; pos < SRC_LEN; pos += STREAM_BLOCK_SIZE) {
+    size_t len = SRC_LEN - pos < STREAM_BLOCK_SIZE ? SRC_LEN - pos : STREAM_BLOCK_SIZE;
+    size_t written = stream_compress_block(cctx, dstp, dst + dstsize - dstp, src + pos, len);
+    assert(written);
+    dstp += written;
+  }
+
+  const byte_t* streamp = dst;
+  byte_t* outp = out;
+  while (streamp < dstp) {
+    const byte_t* block;
+    size_t blocksize;
+    assert(stream_read_block(&streamp, dstp - streamp, &block, &blocksize));
+    size_t size = decompress(outp, out + SRC_LEN - outp, block, blocksize);
+    assert(size);
+    outp += size;
+  }
+  assert(streamp == dstp);
+  assert(outp == out + SRC_LEN);
+  assert(!memcmp(src, out, SRC_LEN));
+
+  // a truncated stream must be rejected
+  streamp = dst;
+  const byte_t* block;
+  size_t blocksize;
+  assert(!stream_read_block(&streamp, 10, &block, &blocksize));
+
+  free_cctx(cctx);
+  free(out);
+  free(dst);
+  free(src);
+}
+
+void test_adapt_policy(void) {
+  adapt_t adapt;
+  adapt_init(&adapt, 2, 8);
+  assert(adapt.acceleration == 2);
+
+  // compressing is the bottleneck: speed up, but not past the max
+  for (int i = 0; i < 20; i++) {
+    adapt_update(&adapt, 1000, 100);
+  }
+  assert(adapt.acceleration == 8);
+
+  // balanced: stay put
+  for (int i = 0; i < 20; i++) {
+    adapt_update(&adapt, 1000, 1000);
+  }
+  assert(adapt.acceleration == 8);
+
+  // draining the output is the bottleneck: slow down, but not past the min
+  for (int i = 0; i < 20; i++) {
+    adapt_update(&adapt, 100, 1000);
+  }
+  assert(adapt.acceleration == 2);
+}
+
+int main() {
+  test_stream_roundtrip(1);
+  test_stream_roundtrip(7);
+  test_adapt_policy();
+
+  return 0;
+}
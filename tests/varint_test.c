@@ -14,6 +14,7 @@ size_t expected_encoded_size(uint64_t val) {
 
 void check_encode_decode(byte_t* buf, size_t size, uint64_t val) {
   ptrdiff_t expected_size = expected_encoded_size(val);
+  assert(varint_size(val) == (size_t) expected_size);
 
   byte_t *bufp1 = buf;
   assert(varint_encode(&bufp1, size, val));
@@ -11,6 +11,17 @@
  * next byte.
  */
 
+// the longest encoding of a uint64_t
+#define VARINT_MAX_SIZE 10
+
+/**
+ * Returns how many bytes varint_encode() would take to encode val.
+ */
+static inline size_t varint_size(uint64_t val) {
+  // 0 still takes a byte; otherwise one byte per started group of 7 bits
+  return (63 - __builtin_clzll(val | 1)) / 7 + 1;
+}
+
 /**
  * Encode a uint64_t into the beginning of the provided buffer. Advance the
  * buffer pointer to the first byte past the encoded value. Returns whether